@@ -1,103 +1,432 @@
 #define _GNU_SOURCE
 #include <errno.h>
-#include <netinet/in.h>
-#include <pthread.h>
-#include <semaphore.h>
+#include <math.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
+#include "timer_wheel.h"
 
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
 
-#define FS_NUM 5
 #define MAX_INPUT 120
-volatile sig_atomic_t work = 1;
+#define INPUT_BUF 65536  // stdin is read this much at a time and split into lines
+#define TICK_NS 10000L   // wheel resolution, 10 us; delays up to about 7.9 days
+#define MAX_DELAY_NS ((long)(TW_MAX_DELTA - 1) * TICK_NS) // one tick spare for rounding the deadline up
+#define ALARM_PROMPT "Please enter the alarm delay: seconds, or with an s/ms/us suffix (or c <id> to cancel):"
+#define ALARM_CHUNK 4096 // alarms are allocated this many at a time and never move
 
-void sigint_handler(int sig) { work = 0; }
+/* lateness histogram: 16 linear sub-buckets per power of two of nanoseconds */
+#define LATE_SUB_BITS 4
+#define LATE_BUCKETS ((64 - LATE_SUB_BITS) << LATE_SUB_BITS)
 
-int set_handler(void (*f)(int), int sigNo)
+/*
+ * One thread and one epoll loop: stdin, a signalfd for SIGINT and a
+ * timerfd armed for the next tick that matters in the timing wheel.
+ * Input is read in large blocks, so a pipe or file full of alarm lines
+ * is taken a batch at a time, and the timerfd is re-armed once per
+ * batch. An alarm costs one small record instead of a thread.
+ */
+
+typedef struct alarm
+{
+    tw_timer_t timer; // first, so a tw_timer_t * is the alarm
+    uint32_t idx;
+    uint32_t gen;     // bumped on every reuse so stale ids cannot cancel
+    uint32_t next_free;
+    int active;
+    long deadline; // CLOCK_MONOTONIC ns the alarm was asked to ring at
+} alarm_t;
+
+typedef struct alarm_clock
+{
+    timer_wheel_t wheel;
+    long base_ns; // CLOCK_MONOTONIC time of tick 0
+    int tfd;
+    uint64_t armed; // tick the timerfd fires at, UINT64_MAX when disarmed
+
+    alarm_t **chunks;
+    uint32_t nchunks;
+    uint32_t used;      // ids handed out so far
+    uint32_t free_head; // UINT32_MAX when empty
+
+    long set, fired;
+    long late_hist[LATE_BUCKETS]; // time the "Wake up" line was flushed minus deadline
+    long late_max;
+} alarm_clock_t;
+
+long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void alarm_clock_init(alarm_clock_t *clock)
+{
+    memset(clock, 0, sizeof(*clock));
+    if ((clock->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK)) == -1)
+        ERR("timerfd_create");
+    clock->base_ns = now_ns();
+    clock->armed = UINT64_MAX;
+    clock->free_head = UINT32_MAX;
+    tw_init(&clock->wheel, 0);
+}
+
+void alarm_clock_free(alarm_clock_t *clock)
+{
+    for (uint32_t i = 0; i < clock->nchunks; i++)
+        free(clock->chunks[i]);
+    free(clock->chunks);
+    close(clock->tfd);
+}
+
+alarm_t *alarm_at(alarm_clock_t *clock, uint32_t idx) { return &clock->chunks[idx / ALARM_CHUNK][idx % ALARM_CHUNK]; }
+
+uint32_t alarm_new(alarm_clock_t *clock)
+{
+    uint32_t idx = clock->free_head;
+    if (idx != UINT32_MAX)
+    {
+        clock->free_head = alarm_at(clock, idx)->next_free;
+        return idx;
+    }
+    if (clock->used == clock->nchunks * ALARM_CHUNK)
+    {
+        alarm_t **chunks = realloc(clock->chunks, sizeof(alarm_t *) * (clock->nchunks + 1));
+        if (!chunks)
+            ERR("realloc");
+        clock->chunks = chunks;
+        if (!(clock->chunks[clock->nchunks] = calloc(ALARM_CHUNK, sizeof(alarm_t))))
+            ERR("calloc");
+        clock->nchunks++;
+    }
+    alarm_at(clock, clock->used)->idx = clock->used;
+    return clock->used++;
+}
+
+void alarm_free(alarm_clock_t *clock, uint32_t idx)
+{
+    alarm_t *a = alarm_at(clock, idx);
+    a->active = 0;
+    a->gen++;
+    a->next_free = clock->free_head;
+    clock->free_head = idx;
+}
+
+void arm(alarm_clock_t *clock, uint64_t tick)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (tick != UINT64_MAX)
+    {
+        long at = clock->base_ns + (long)tick * TICK_NS;
+        its.it_value.tv_sec = at / 1000000000L;
+        its.it_value.tv_nsec = at % 1000000000L;
+    }
+    if (timerfd_settime(clock->tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+        ERR("timerfd_settime");
+    clock->armed = tick;
+}
+
+void alarm_ring(alarm_clock_t *clock, long now);
+
+/* Returns the id used to cancel the alarm. The caller re-arms the timerfd. */
+uint64_t alarm_set(alarm_clock_t *clock, long delay_ns)
 {
-    struct sigaction act;
-    memset(&act, 0, sizeof(struct sigaction));
-    act.sa_handler = f;
-    if (-1 == sigaction(sigNo, &act, NULL))
+    long now = now_ns();
+    // round up so an alarm never rings early
+    uint64_t tick = (uint64_t)((now + delay_ns - clock->base_ns + TICK_NS - 1) / TICK_NS);
+    // the wheel only moves when the timerfd fires, so after an idle spell its now
+    // can be far enough behind that tw_add would clamp a long delay
+    if (tick - clock->wheel.now > TW_MAX_DELTA)
+        alarm_ring(clock, now);
+
+    uint32_t idx = alarm_new(clock);
+    alarm_t *a = alarm_at(clock, idx);
+    a->active = 1;
+    a->deadline = now + delay_ns;
+    tw_add(&clock->wheel, &a->timer, tick);
+    clock->set++;
+    return (uint64_t)a->gen << 32 | idx;
+}
+
+/* 0 if it was cancelled, -1 if there is no such pending alarm. */
+int alarm_cancel(alarm_clock_t *clock, uint64_t id)
+{
+    uint32_t idx = (uint32_t)id;
+    if (idx >= clock->used)
+        return -1;
+    alarm_t *a = alarm_at(clock, idx);
+    if (!a->active || a->gen != (uint32_t)(id >> 32))
         return -1;
+    // the timerfd may still fire for it; that wake-up just finds nothing due
+    tw_cancel(&clock->wheel, &a->timer);
+    alarm_free(clock, idx);
     return 0;
 }
 
-struct arguments
+/* Only ever moves the timerfd earlier; alarm_fire re-arms it after each expiry. */
+void rearm(alarm_clock_t *clock)
 {
-    int32_t time;
-    sem_t *semaphore;
-};
+    uint64_t next = tw_next_tick(&clock->wheel);
+    if (next < clock->armed)
+        arm(clock, next);
+}
+
+void record_lateness(alarm_clock_t *clock, long late)
+{
+    unsigned long v = late > 0 ? (unsigned long)late : 0;
+    int bucket = v;
+    if (v >= 1UL << LATE_SUB_BITS)
+    {
+        int msb = 63 - __builtin_clzl(v);
+        bucket = ((msb - LATE_SUB_BITS + 1) << LATE_SUB_BITS) + (int)((v >> (msb - LATE_SUB_BITS)) & ((1 << LATE_SUB_BITS) - 1));
+    }
+    clock->late_hist[bucket]++;
+    if (late > clock->late_max)
+        clock->late_max = late;
+}
 
-void *thread_func(void *arg)
+/* Lower edge of a late_hist bucket in nanoseconds. */
+long late_bucket_ns(int bucket)
 {
-    struct arguments *args = (struct arguments *)arg;
-    uint32_t tt;
-    fprintf(stderr, "Will sleep for %d\n", args->time);
-    for (tt = args->time; tt > 0; tt = sleep(tt))
-        ;
-    puts("Wake up");
-    if (sem_post(args->semaphore) == -1)
-        ERR("sem_post");
-    free(args);
-    return NULL;
+    if (bucket < 1 << LATE_SUB_BITS)
+        return bucket;
+    int msb = (bucket >> LATE_SUB_BITS) + LATE_SUB_BITS - 1;
+    long sub = bucket & ((1 << LATE_SUB_BITS) - 1);
+    return ((1L << LATE_SUB_BITS) + sub) << (msb - LATE_SUB_BITS);
+}
+
+void print_lateness(alarm_clock_t *clock)
+{
+    static const double quantiles[] = {0.5, 0.99, 0.999};
+    static const char *names[] = {"p50", "p99", "p999"};
+    long total = 0, seen = 0;
+    int b = 0;
+
+    for (int i = 0; i < LATE_BUCKETS; i++)
+        total += clock->late_hist[i];
+    if (!total)
+        return;
+    fprintf(stderr, "lateness over %ld alarms (us):", total);
+    for (int q = 0; q < 3; q++)
+    {
+        long rank = (long)(quantiles[q] * total + 0.5);
+        if (rank < 1)
+            rank = 1;
+        while (b < LATE_BUCKETS && seen + clock->late_hist[b] < rank)
+            seen += clock->late_hist[b++];
+        fprintf(stderr, " %s %.1f", names[q], late_bucket_ns(b) / 1e3);
+    }
+    fprintf(stderr, " max %.1f\n", clock->late_max / 1e3);
+}
+
+/*
+ * Advances the wheel to now and rings every alarm it passed. The batch
+ * reaches stdout in one flush, and lateness is taken after it, so every
+ * alarm is charged for the write and for the lines formatted before it.
+ */
+void alarm_ring(alarm_clock_t *clock, long now)
+{
+    tw_timer_t expired;
+    int fired = 0;
+
+    tw_list_init(&expired);
+    tw_advance(&clock->wheel, (uint64_t)((now - clock->base_ns) / TICK_NS), &expired);
+    arm(clock, tw_next_tick(&clock->wheel));
+
+    // the whole batch in one stdio lock
+    flockfile(stdout);
+    for (tw_timer_t *t = expired.next; t != &expired; t = t->next)
+        fputs_unlocked("Wake up\n", stdout);
+    fflush_unlocked(stdout);
+    funlockfile(stdout);
+
+    long written = now_ns();
+    while (expired.next != &expired)
+    {
+        alarm_t *a = (alarm_t *)expired.next;
+        tw_list_del(&a->timer);
+        record_lateness(clock, written - a->deadline);
+        alarm_free(clock, a->idx);
+        fired++;
+    }
+    clock->fired += fired;
+}
+
+void alarm_fire(alarm_clock_t *clock)
+{
+    uint64_t expirations;
+    if (read(clock->tfd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+        ERR("read");
+    alarm_ring(clock, now_ns());
+}
+
+/* "2", "1.5s", "250ms" or "800us"; -1 when it is not a valid delay. */
+long parse_delay(const char *s)
+{
+    char *end;
+    double v = strtod(s, &end), scale = 1e9;
+    if (end == s)
+        return -1;
+    if (strncmp(end, "ms", 2) == 0)
+        scale = 1e6, end += 2;
+    else if (strncmp(end, "us", 2) == 0)
+        scale = 1e3, end += 2;
+    else if (*end == 's')
+        end++;
+    while (*end == ' ' || *end == '\t' || *end == '\r')
+        end++;
+    v *= scale;
+    if (*end || !isfinite(v) || v < 1 || v > MAX_DELAY_NS)
+        return -1;
+    return (long)v;
+}
+
+void handle_line(alarm_clock_t *clock, char *line, int verbose)
+{
+    if (line[0] == 'c') {
+        uint64_t id = strtoull(line + 1, NULL, 10);
+        if (alarm_cancel(clock, id) == -1)
+            fprintf(stderr, "No pending alarm %llu\n", (unsigned long long)id);
+        return;
+    }
+
+    long delay = parse_delay(line);
+    if(delay <= 0) {
+        fputs("Incorrect time specified\n", stderr);
+        return;
+    }
+
+    uint64_t id = alarm_set(clock, delay);
+    if (verbose)
+        fprintf(stderr, "Will sleep for %.6g s (alarm %llu)\n", delay / 1e9, (unsigned long long)id);
+}
+
+/*
+ * Reads whatever stdin has and handles every complete line of it; a
+ * trailing partial line is kept for the next call. Returns 0 at EOF.
+ */
+int read_input(alarm_clock_t *clock, char *buf, size_t *len, int verbose)
+{
+    ssize_t got = read(STDIN_FILENO, buf + *len, INPUT_BUF - 1 - *len);
+    if (got == -1) {
+        if (errno == EINTR || errno == EAGAIN)
+            return 1;
+        ERR("read");
+    }
+    if (got == 0 && *len > 0)
+        buf[(*len)++] = '\n'; // last line without a newline
+    *len += (size_t)got;
+
+    char *line = buf, *end = buf + *len, *nl;
+    while ((nl = memchr(line, '\n', (size_t)(end - line)))) {
+        *nl = '\0';
+        if (nl - line < MAX_INPUT)
+            handle_line(clock, line, verbose);
+        else
+            fputs("Input line too long\n", stderr);
+        line = nl + 1;
+    }
+    *len = (size_t)(end - line);
+    if (*len == INPUT_BUF - 1) {
+        fputs("Input line too long\n", stderr);
+        *len = 0;
+    }
+    memmove(buf, line, *len);
+    rearm(clock);
+    return got != 0;
 }
 
 void do_work()
 {
-    int32_t time;
-    pthread_t thread;
-    char input[MAX_INPUT];
-    struct arguments *args;
-    sem_t semaphore;
-    if (sem_init(&semaphore, 0, FS_NUM) != 0)
-        ERR("sem_init");
-    while (work)
+    alarm_clock_t clock;
+    struct epoll_event ev, events[8];
+    sigset_t mask;
+    char *buf;
+    size_t len = 0;
+    int sfd, epfd, open_input = 1, stdin_polled = 1;
+    int interactive = isatty(STDIN_FILENO);
+
+    alarm_clock_init(&clock);
+    if (!(buf = malloc(INPUT_BUF)))
+        ERR("malloc");
+
+    // SIGINT is read from the signalfd, so nothing is ever interrupted
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        ERR("sigprocmask");
+    if ((sfd = signalfd(-1, &mask, SFD_CLOEXEC)) == -1)
+        ERR("signalfd");
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        ERR("epoll_create1");
+    ev.events = EPOLLIN;
+    ev.data.fd = clock.tfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, clock.tfd, &ev) == -1)
+        ERR("epoll_ctl");
+    ev.data.fd = sfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev) == -1)
+        ERR("epoll_ctl");
+    ev.data.fd = STDIN_FILENO;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == -1) {
+        // regular files cannot be polled and are always readable
+        if (errno != EPERM)
+            ERR("epoll_ctl");
+        stdin_polled = 0;
+    }
+
+    if (interactive)
+        puts(ALARM_PROMPT);
+    // after EOF, run until every pending alarm has rung
+    while (open_input || clock.wheel.count > 0)
     {
-        puts("Please enter the number of seconds for the alarm delay:");
-        if(fgets(input, MAX_INPUT, stdin) == NULL) {
+        int busy = open_input && !stdin_polled;
+        int n = epoll_wait(epfd, events, 8, busy ? 0 : -1);
+        if (n == -1) {
             if (errno == EINTR)
                 continue;
-            ERR("fgets:");
+            ERR("epoll_wait");
         }
-        
-        time = atoi(input);
-        if(time <= 0) {
-            fputs("Incorrect time specified", stderr);
-            continue;
-        }
-        
-        if (TEMP_FAILURE_RETRY(sem_trywait(&semaphore)) == -1)
+        for (int i = 0; i < n; i++)
         {
-            switch (errno)
-            {
-                case EAGAIN:
-                    fprintf(stderr, "Only %d alarms can be set at the time.", FS_NUM);
-                case EINTR:
-                    continue;
+            if (events[i].data.fd == clock.tfd) {
+                alarm_fire(&clock);
+            } else if (events[i].data.fd == sfd) {
+                struct signalfd_siginfo si;
+                if (read(sfd, &si, sizeof(si)) != sizeof(si))
+                    ERR("read");
+                goto out;
+            } else if (!(open_input = read_input(&clock, buf, &len, interactive))) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+            } else if (interactive) {
+                puts(ALARM_PROMPT);
             }
-            ERR("sem_trywait");
         }
-        
-        if ((args = (struct arguments *)malloc(sizeof(struct arguments))) == NULL)
-            ERR("malloc:");
-        args->time = time;
-        args->semaphore = &semaphore;
-        if (pthread_create(&thread, NULL, thread_func, (void *) args) != 0)
-            ERR("pthread_create");
-        if (pthread_detach(thread) != 0)
-            ERR("pthread_detach");
+        if (busy)
+            open_input = read_input(&clock, buf, &len, interactive);
     }
+out:
+    if (!interactive)
+        fprintf(stderr, "%ld alarms set, %ld rang, %zu pending\n", clock.set, clock.fired, clock.wheel.count);
+    print_lateness(&clock);
+
+    alarm_clock_free(&clock);
+    free(buf);
+    close(epfd);
+    close(sfd);
 }
 
-int main(int argc, char **argv)
+int main(void)
 {
-    if (set_handler(sigint_handler, SIGINT))
-        ERR("Seting SIGINT:");
     do_work();
     fprintf(stderr, "Program has terminated.\n");
     return EXIT_SUCCESS;
@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
+
+/*
+ * Load generator for alarm: starts it with its stdin and stdout on pipes,
+ * feeds it alarm lines at a fixed rate (or as fast as it takes them) and
+ * counts the "Wake up" lines that come back. Reports the submission rate
+ * actually achieved and whether every alarm rang.
+ *
+ * usage: alarm_gen [lines per second, 0 = flat out] [seconds] [max delay ms] [alarm binary]
+ */
+
+#define OUT_BUF 65536
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static pid_t spawn(const char *path, int *to_child, int *from_child)
+{
+    int in[2], out[2];
+    if (pipe(in) == -1 || pipe(out) == -1)
+        ERR("pipe");
+    pid_t pid = fork();
+    if (pid == -1)
+        ERR("fork");
+    if (pid == 0) {
+        if (dup2(in[0], STDIN_FILENO) == -1 || dup2(out[1], STDOUT_FILENO) == -1)
+            ERR("dup2");
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execl(path, path, (char *)NULL);
+        ERR("execl");
+    }
+    close(in[0]);
+    close(out[1]);
+    if (fcntl(in[1], F_SETFL, O_NONBLOCK) == -1)
+        ERR("fcntl");
+    *to_child = in[1];
+    *from_child = out[0];
+    return pid;
+}
+
+/* Counts "Wake up\n" lines by their newlines; returns 0 at EOF. */
+static int drain(int fd, long *wakes)
+{
+    char buf[OUT_BUF];
+    ssize_t got = read(fd, buf, sizeof(buf));
+    if (got == -1) {
+        if (errno == EINTR)
+            return 1;
+        ERR("read");
+    }
+    for (ssize_t i = 0; i < got; i++)
+        *wakes += buf[i] == '\n';
+    return got != 0;
+}
+
+int main(int argc, char **argv)
+{
+    long rate = argc > 1 ? atol(argv[1]) : 10000;
+    double seconds = argc > 2 ? atof(argv[2]) : 5;
+    int max_delay = argc > 3 ? atoi(argv[3]) : 2000;
+    const char *path = argc > 4 ? argv[4] : "./alarm";
+    char out[OUT_BUF];
+    size_t out_len = 0;
+    long sent = 0, wakes = 0;
+    unsigned seed = 1;
+    int to_child, from_child;
+
+    if (rate < 0 || seconds <= 0 || max_delay <= 0) {
+        fprintf(stderr, "usage: %s [lines per second, 0 = flat out] [seconds] [max delay ms] [alarm binary]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t pid = spawn(path, &to_child, &from_child);
+    double t0 = now_s(), sent_at = 0, last_wake = 0;
+
+    while (to_child != -1 || from_child != -1) {
+        double t = now_s() - t0;
+        if (to_child != -1) {
+            long due = sent;
+            if (t < seconds)
+                due = rate ? (long)(t * rate) : sent + OUT_BUF / 4;
+            else if (rate)
+                due = (long)(seconds * rate);
+            while (sent < due && out_len + 16 < sizeof(out)) {
+                out_len += (size_t)sprintf(out + out_len, "%dms\n", 1 + (int)(rand_r(&seed) % max_delay));
+                sent++;
+            }
+            if (out_len == 0 && t >= seconds) {
+                sent_at = t;
+                close(to_child); // EOF: alarm exits once everything has rung
+                to_child = -1;
+            }
+        }
+
+        struct pollfd fds[2] = {{from_child, POLLIN, 0}, {to_child, out_len ? POLLOUT : 0, 0}};
+        if (poll(fds, 2, 1) == -1) {
+            if (errno == EINTR)
+                continue;
+            ERR("poll");
+        }
+        if (fds[0].revents) {
+            long before = wakes;
+            if (!drain(from_child, &wakes)) {
+                close(from_child);
+                from_child = -1;
+            }
+            if (wakes != before)
+                last_wake = now_s() - t0;
+        }
+        if (fds[1].revents & (POLLOUT | POLLERR)) {
+            ssize_t put = write(to_child, out, out_len);
+            if (put == -1 && errno != EAGAIN && errno != EINTR)
+                ERR("write");
+            if (put > 0) {
+                memmove(out, out + put, out_len - (size_t)put);
+                out_len -= (size_t)put;
+            }
+        }
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1)
+        ERR("waitpid");
+    printf("sent %ld alarms in %.2f s (%.0f/s), %ld rang, last at %.2f s, %ld lost\n",
+           sent, sent_at, sent / sent_at, wakes, last_wake, sent - wakes);
+    return sent == wakes ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,161 @@
+#ifndef CHUNK_PLAN_H
+#define CHUNK_PLAN_H
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Chunk planning shared by main.c and prog1.c.
+ *
+ * The data section [data_start, data_end) is cut into pieces of roughly
+ * equal size and every cut is moved forward to the byte after the next
+ * '\n', so no line ever spans two chunks and workers never have to probe
+ * the bytes before their start. That '\n' may sit inside a quoted field;
+ * callers that need whole records move the cuts on with snap_to_records.
+ */
+
+#define PLAN_SCAN_BUF 4096
+#define PLAN_RECORD_BUF 65536
+
+/* "8M", "512K", "1G" or plain bytes; -1 when the string is not a size */
+static inline long parse_size(const char *s)
+{
+    char *end;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (errno || end == s || v <= 0)
+        return -1;
+    switch (*end) {
+        case 'k': case 'K': v <<= 10; end++; break;
+        case 'm': case 'M': v <<= 20; end++; break;
+        case 'g': case 'G': v <<= 30; end++; break;
+    }
+    if (*end == 'B' || *end == 'b')
+        end++;
+    return *end ? -1 : v;
+}
+
+/* Offset just past the first '\n' at or after pos - 1, capped at limit. */
+static inline long snap_to_line(int fd, long pos, long limit)
+{
+    char buf[PLAN_SCAN_BUF];
+    long at = pos - 1;
+
+    while (at < limit) {
+        size_t want = limit - at < PLAN_SCAN_BUF ? (size_t)(limit - at) : PLAN_SCAN_BUF;
+        ssize_t got = pread(fd, buf, want, at);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        for (ssize_t i = 0; i < got; i++)
+            if (buf[i] == '\n')
+                return at + i + 1;
+        at += got;
+    }
+    return limit;
+}
+
+/*
+ * Fills *bounds_out with count + 1 offsets (chunk i is [bounds[i], bounds[i+1]))
+ * and returns count, or -1 on read error. When chunk_bytes > 0 it decides
+ * the chunk count, otherwise the data is split into m pieces. Cuts that
+ * collapse onto the same line are merged, so count may be smaller than m.
+ */
+static inline int plan_chunks(int fd, long data_start, long data_end, int m, long chunk_bytes, long **bounds_out)
+{
+    long data_size = data_end - data_start;
+    if (chunk_bytes > 0)
+        m = (int)((data_size + chunk_bytes - 1) / chunk_bytes);
+    if (m < 1)
+        m = 1;
+
+    long *bounds = malloc(sizeof(long) * (m + 1));
+    if (!bounds)
+        return -1;
+
+    long step = data_size / m;
+    int count = 0;
+    bounds[0] = data_start;
+    for (int i = 1; i < m; i++) {
+        long cut = chunk_bytes > 0 ? data_start + i * chunk_bytes : data_start + i * step;
+        if (cut <= bounds[count])
+            continue;
+        cut = snap_to_line(fd, cut, data_end);
+        if (cut < 0) {
+            free(bounds);
+            return -1;
+        }
+        if (cut > bounds[count] && cut < data_end)
+            bounds[++count] = cut;
+    }
+    if (data_end > bounds[count])
+        bounds[++count] = data_end;
+
+    *bounds_out = bounds;
+    return count;
+}
+
+/*
+ * Moves the inner cuts of bounds[0 .. count] forward to record
+ * boundaries, the byte after a '\n' outside quoted fields, and merges
+ * cuts that collapse. The quote state is only known from the start of
+ * the data, so this reads everything up to the last cut once, in order.
+ * Returns the new count, or -1 on read error.
+ */
+static inline int snap_to_records(int fd, long *bounds, int count)
+{
+    char *buf = malloc(PLAN_RECORD_BUF);
+    if (!buf)
+        return -1;
+
+    long at = bounds[0], end = bounds[count];
+    int in_quotes = 0, seeking = 0, out = 0;
+    for (int i = 1; i < count && at < end; i++) {
+        long cut = bounds[i];
+        if (cut <= bounds[out])
+            continue;
+        // quote parity up to the cut, then on to the first unquoted '\n'
+        while (at < end) {
+            long want = (seeking ? end : cut) - at;
+            if (want == 0) {
+                if (!in_quotes)
+                    break;
+                seeking = 1;
+                continue;
+            }
+            ssize_t got = pread(fd, buf, want < PLAN_RECORD_BUF ? want : PLAN_RECORD_BUF, at);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0) {
+                free(buf);
+                return -1;
+            }
+            ssize_t j = 0;
+            if (!seeking) {
+                for (const char *q = buf; (q = memchr(q, '"', buf + got - q)); q++)
+                    in_quotes = !in_quotes;
+                j = got;
+            } else {
+                for (; j < got && (in_quotes || buf[j] != '\n'); j++)
+                    if (buf[j] == '"')
+                        in_quotes = !in_quotes;
+                if (j < got) {
+                    at += j + 1;
+                    seeking = 0;
+                    break;
+                }
+            }
+            at += j;
+        }
+        if (at < end)
+            bounds[++out] = at;
+    }
+    bounds[++out] = end;
+    free(buf);
+    return out;
+}
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef CSV_VALIDATE_H
+#define CSV_VALIDATE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSV_HAVE_X86 1
+#endif
+
+/*
+ * Column-count validation over whole chunks.
+ *
+ * The input is classified 64 bytes at a time into bitmasks of quotes,
+ * commas and newlines (SSE2 or AVX2, picked at runtime, scalar
+ * elsewhere). A prefix-XOR over the quote mask gives the bytes that are
+ * inside a quoted field, the same trick simdjson uses, and commas or
+ * newlines there are dropped. What remains is counted per line with
+ * popcount, so the hot loop never branches on individual bytes.
+ */
+
+#define CSV_ALWAYS_INLINE static inline __attribute__((always_inline))
+
+typedef struct {
+    uint64_t quote;
+    uint64_t comma;
+    uint64_t newline;
+} csv_block_t;
+
+typedef void (*csv_classify_fn)(const char *block, csv_block_t *out);
+
+/*
+ * Where one chunk leaves off. Chunks are cut after a '\n', but that
+ * newline may sit inside a quoted field, so a line can carry over.
+ */
+typedef struct {
+    int in_quotes;   // the next chunk starts inside a quoted field
+    long commas;     // unquoted commas of the carried line so far
+    long line_start; // start of the carried line relative to the next chunk, <= 0
+} csv_state_t;
+
+/* True when the chunk starts on a line of its own, as after a fresh csv_state_t. */
+static inline int csv_state_clean(const csv_state_t *st)
+{
+    return !st->in_quotes && st->commas == 0 && st->line_start == 0;
+}
+
+CSV_ALWAYS_INLINE void csv_classify_scalar(const char *block, csv_block_t *out)
+{
+    uint64_t q = 0, c = 0, n = 0;
+    for (int i = 0; i < 64; i++) {
+        uint64_t bit = (uint64_t)1 << i;
+        q |= block[i] == '"' ? bit : 0;
+        c |= block[i] == ',' ? bit : 0;
+        n |= block[i] == '\n' ? bit : 0;
+    }
+    out->quote = q;
+    out->comma = c;
+    out->newline = n;
+}
+
+#ifdef CSV_HAVE_X86
+CSV_ALWAYS_INLINE __attribute__((target("sse2"))) uint64_t csv_eq16(const __m128i v[4], char ch)
+{
+    __m128i needle = _mm_set1_epi8(ch);
+    uint64_t m = 0;
+    for (int i = 0; i < 4; i++)
+        m |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], needle)) << (16 * i);
+    return m;
+}
+
+CSV_ALWAYS_INLINE __attribute__((target("sse2"))) void csv_classify_sse2(const char *block, csv_block_t *out)
+{
+    __m128i v[4];
+    for (int i = 0; i < 4; i++)
+        v[i] = _mm_loadu_si128((const __m128i *)(block + 16 * i));
+    out->quote = csv_eq16(v, '"');
+    out->comma = csv_eq16(v, ',');
+    out->newline = csv_eq16(v, '\n');
+}
+
+CSV_ALWAYS_INLINE __attribute__((target("avx2"))) uint64_t csv_eq32(__m256i lo, __m256i hi, char ch)
+{
+    __m256i needle = _mm256_set1_epi8(ch);
+    uint64_t l = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, needle));
+    uint64_t h = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, needle));
+    return l | h << 32;
+}
+
+CSV_ALWAYS_INLINE __attribute__((target("avx2"))) void csv_classify_avx2(const char *block, csv_block_t *out)
+{
+    __m256i lo = _mm256_loadu_si256((const __m256i *)block);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(block + 32));
+    out->quote = csv_eq32(lo, hi, '"');
+    out->comma = csv_eq32(lo, hi, ',');
+    out->newline = csv_eq32(lo, hi, '\n');
+}
+#endif
+
+/* Bit i of the result is the XOR of bits 0..i: 1 between an opening and closing quote. */
+CSV_ALWAYS_INLINE uint64_t csv_prefix_xor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+/*
+ * Shared driver, inlined into one copy per instruction set so classify
+ * is a direct (inlined) call. Continues from *st and returns 1 with *bad
+ * set to the offset of the first line whose unquoted comma count is not
+ * expected, or 0. The last line is checked only when last is set;
+ * otherwise it is left in *st for the next chunk. The scan goes on past
+ * a bad line so *st is right either way.
+ */
+CSV_ALWAYS_INLINE int csv_validate_blocks(const char *buf, size_t len, int expected, csv_state_t *st, int last,
+                                          long *bad, csv_classify_fn classify)
+{
+    uint64_t in_quotes = st->in_quotes ? ~(uint64_t)0 : 0; // all ones when the previous block ended inside quotes
+    long line_start = st->line_start;
+    long commas = st->commas; // unquoted commas seen so far on the current line
+    int failed = 0;
+    char tail[64];
+
+    for (size_t base = 0; base < len; base += 64) {
+        const char *block = buf + base;
+        uint64_t valid = ~(uint64_t)0;
+        if (len - base < 64) {
+            // zero padding classifies as nothing, so the tail needs no special case
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, block, len - base);
+            block = tail;
+            valid = ((uint64_t)1 << (len - base)) - 1;
+        }
+
+        csv_block_t m;
+        classify(block, &m);
+        uint64_t quoted = csv_prefix_xor(m.quote) ^ in_quotes;
+        in_quotes = (uint64_t)((int64_t)quoted >> 63);
+        uint64_t comma = m.comma & ~quoted & valid;
+        uint64_t newline = m.newline & ~quoted & valid;
+
+        while (newline) {
+            int pos = __builtin_ctzll(newline);
+            uint64_t before = ((uint64_t)1 << pos) - 1;
+            commas += __builtin_popcountll(comma & before);
+            if (commas != expected && !failed) {
+                *bad = line_start;
+                failed = 1;
+            }
+            comma &= ~before;
+            newline &= newline - 1;
+            line_start = (long)(base + pos + 1);
+            commas = 0;
+        }
+        commas += __builtin_popcountll(comma);
+    }
+
+    // last line without a trailing newline
+    if (last && !failed && line_start < (long)len && commas != expected) {
+        *bad = line_start;
+        failed = 1;
+    }
+    st->in_quotes = (int)(in_quotes & 1);
+    st->commas = commas;
+    st->line_start = line_start - (long)len;
+    return failed;
+}
+
+static int csv_validate_scalar(const char *buf, size_t len, int expected, csv_state_t *st, int last, long *bad)
+{
+    return csv_validate_blocks(buf, len, expected, st, last, bad, csv_classify_scalar);
+}
+
+#ifdef CSV_HAVE_X86
+__attribute__((target("sse2"))) static int csv_validate_sse2(const char *buf, size_t len, int expected, csv_state_t *st, int last, long *bad)
+{
+    return csv_validate_blocks(buf, len, expected, st, last, bad, csv_classify_sse2);
+}
+
+__attribute__((target("avx2"))) static int csv_validate_avx2(const char *buf, size_t len, int expected, csv_state_t *st, int last, long *bad)
+{
+    return csv_validate_blocks(buf, len, expected, st, last, bad, csv_classify_avx2);
+}
+#endif
+
+typedef int (*csv_validate_fn)(const char *buf, size_t len, int expected, csv_state_t *st, int last, long *bad);
+
+/* Picks the widest implementation the CPU supports. */
+static inline csv_validate_fn csv_pick_validator(void)
+{
+#ifdef CSV_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return csv_validate_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return csv_validate_sse2;
+#endif
+    return csv_validate_scalar;
+}
+
+/*
+ * Validates the lines of one chunk, continuing from *st (zeroed for the
+ * first chunk). Returns 1 with *bad set to the offset of the first bad
+ * line, relative to buf and negative when that line began in an earlier
+ * chunk, or 0. Unless last is set, the line still open at the end of
+ * the chunk is not checked; *st then describes it for the next chunk.
+ */
+static inline int csv_validate_resume(const char *buf, size_t len, int expected, csv_state_t *st, int last, long *bad)
+{
+    static csv_validate_fn impl;
+    csv_validate_fn f = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+    if (!f) {
+        f = csv_pick_validator(); // every thread picks the same one
+        __atomic_store_n(&impl, f, __ATOMIC_RELAXED);
+    }
+    return f(buf, len, expected, st, last, bad);
+}
+
+/*
+ * Validates every line in [buf, buf + len). Returns the offset of the
+ * first bad line or -1. Quote state starts outside a quoted field.
+ */
+static inline ssize_t csv_validate_chunk(const char *buf, size_t len, int expected)
+{
+    csv_state_t st = {0, 0, 0};
+    long bad;
+    return csv_validate_resume(buf, len, expected, &st, 1, &bad) ? bad : -1;
+}
+
+/* Unquoted commas in one line (up to the first unquoted newline); used for the header. */
+static inline int csv_count_commas(const char *line, size_t len)
+{
+    int commas = 0, quoted = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (line[i] == '"')
+            quoted = !quoted;
+        else if (line[i] == '\n' && !quoted)
+            break;
+        else if (line[i] == ',' && !quoted)
+            commas++;
+    }
+    return commas;
+}
+
+#endif
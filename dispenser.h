@@ -0,0 +1,59 @@
+#ifndef DISPENSER_H
+#define DISPENSER_H
+
+#include <stdatomic.h>
+
+/*
+ * Lock-free chunk dispenser shared by main.c and prog1.c.
+ *
+ * Workers take tickets with a single atomic_fetch_add instead of going
+ * through a mutex. With batch > 1 one fetch hands out a run of batch
+ * consecutive chunk indices, which cuts traffic on the counter's cache
+ * line when chunks are small.
+ */
+
+#define CACHE_LINE 64
+
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_long next; // next ticket, alone on its line
+    _Alignas(CACHE_LINE) long total;       // read-only after init
+    int batch;
+} dispenser_t;
+
+/* Per-thread counters, one cache line each so neighbours never false-share. */
+typedef struct {
+    _Alignas(CACHE_LINE) long chunks; // chunks processed
+    long grabs;                       // successful fetches from the dispenser
+    long lines;
+    long bytes;
+} thread_stats_t;
+
+static inline void dispenser_init(dispenser_t *d, long total, int batch)
+{
+    atomic_init(&d->next, 0);
+    d->total = total;
+    d->batch = batch > 0 ? batch : 1;
+}
+
+/*
+ * Claims up to batch chunks. Returns how many were claimed (0 once the
+ * dispenser is drained) and stores the first index in *first.
+ */
+static inline int dispenser_take(dispenser_t *d, long *first)
+{
+    if (atomic_load_explicit(&d->next, memory_order_relaxed) >= d->total)
+        return 0; // don't keep bumping the counter after the end
+    long start = atomic_fetch_add_explicit(&d->next, d->batch, memory_order_relaxed);
+    if (start >= d->total)
+        return 0;
+    *first = start;
+    return start + d->batch > d->total ? (int)(d->total - start) : d->batch;
+}
+
+/* Makes every later dispenser_take return 0, e.g. after an error. */
+static inline void dispenser_drain(dispenser_t *d)
+{
+    atomic_store_explicit(&d->next, d->total, memory_order_relaxed);
+}
+
+#endif
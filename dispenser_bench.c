@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "dispenser.h"
+
+#define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
+
+/*
+ * Microbenchmark: mutex-protected current_chunk_idx (the old scheme in
+ * main.c/prog1.c) against the atomic ticket dispenser, with and without
+ * batching, at 1..64 threads. Every "chunk" only burns a few cycles so
+ * the numbers are dominated by the handout itself.
+ *
+ * usage: dispenser_bench [chunks] [work iterations per chunk]
+ */
+
+#define MAX_THREADS 64
+
+typedef struct {
+    int current_chunk_idx;
+    int total_chunks;
+    pthread_mutex_t mutex;
+} mutex_dispenser_t;
+
+typedef struct {
+    int kind; // 0 = mutex, otherwise the atomic batch size
+    mutex_dispenser_t *md;
+    dispenser_t *ad;
+    int work;
+    pthread_barrier_t *start;
+    thread_stats_t *stats;
+} bench_arg_t;
+
+static void burn(thread_stats_t *st, long idx, int work)
+{
+    volatile long acc = idx;
+    for (int i = 0; i < work; i++)
+        acc = acc * 31 + i;
+    st->chunks++;
+    st->bytes += acc & 1;
+}
+
+void *bench_thread(void *arg)
+{
+    bench_arg_t *a = arg;
+    pthread_barrier_wait(a->start);
+    if (a->kind == 0) {
+        while (1) {
+            int idx = -1;
+            pthread_mutex_lock(&a->md->mutex);
+            if (a->md->current_chunk_idx < a->md->total_chunks)
+                idx = a->md->current_chunk_idx++;
+            pthread_mutex_unlock(&a->md->mutex);
+            if (idx == -1)
+                break;
+            a->stats->grabs++;
+            burn(a->stats, idx, a->work);
+        }
+    } else {
+        long first;
+        int taken;
+        while ((taken = dispenser_take(a->ad, &first)) > 0) {
+            a->stats->grabs++;
+            for (int i = 0; i < taken; i++)
+                burn(a->stats, first + i, a->work);
+        }
+    }
+    return NULL;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(int kind, int threads, int chunks, int work)
+{
+    mutex_dispenser_t md = {.current_chunk_idx = 0, .total_chunks = chunks};
+    dispenser_t ad;
+    pthread_t tids[MAX_THREADS];
+    bench_arg_t args[MAX_THREADS];
+    pthread_barrier_t start;
+    thread_stats_t *stats = aligned_alloc(CACHE_LINE, sizeof(thread_stats_t) * threads);
+    if (!stats)
+        ERR("aligned_alloc");
+
+    pthread_mutex_init(&md.mutex, NULL);
+    dispenser_init(&ad, chunks, kind);
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (int i = 0; i < threads; i++) {
+        stats[i] = (thread_stats_t){0};
+        args[i] = (bench_arg_t){kind, &md, &ad, work, &start, &stats[i]};
+        if (pthread_create(&tids[i], NULL, bench_thread, &args[i]))
+            ERR("pthread_create");
+    }
+    double t0 = now_s(); // workers are parked on the barrier at this point
+    pthread_barrier_wait(&start);
+    long done = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        done += stats[i].chunks;
+    }
+    double elapsed = now_s() - t0;
+    if (done != chunks)
+        fprintf(stderr, "lost chunks: %ld of %d\n", done, chunks);
+
+    pthread_barrier_destroy(&start);
+    pthread_mutex_destroy(&md.mutex);
+    free(stats);
+    return elapsed * 1e9 / chunks;
+}
+
+int main(int argc, char **argv)
+{
+    int chunks = argc > 1 ? atoi(argv[1]) : 1 << 20;
+    int work = argc > 2 ? atoi(argv[2]) : 16;
+    static const int thread_counts[] = {1, 2, 4, 8, 16, 32, 64};
+    static const int kinds[] = {0, 1, 8, 64};
+
+    if (chunks <= 0 || work < 0) {
+        fprintf(stderr, "usage: %s [chunks] [work iterations per chunk]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%d chunks, %d iterations each, ns per chunk\n", chunks, work);
+    printf("%8s %10s %10s %10s %10s\n", "threads", "mutex", "atomic", "atomic k=8", "atomic k=64");
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(*thread_counts); t++) {
+        printf("%8d", thread_counts[t]);
+        for (size_t k = 0; k < sizeof(kinds) / sizeof(*kinds); k++)
+            printf(" %10.2f", run(kinds[k], thread_counts[t], chunks, work));
+        printf("\n");
+    }
+    return EXIT_SUCCESS;
+}
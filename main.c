@@ -1,25 +1,51 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <sys/stat.h>
+#include "arena.h"
+#include "chunk_plan.h"
+#include "csv_validate.h"
+#include "dispenser.h"
 
 // --- Data Structures ---
 
-// A node for the Linked List to store lines
+// A node for the Linked List to store lines.
+// Nodes and their text live in the owning thread's arena.
 typedef struct Node {
     char *line;
     struct Node *next;
 } Node;
 
-// Defines a specific chunk of the file to process
+// Defines a specific chunk of the file to process.
+// Chunks are planned in main so that start_offset is always the first
+// byte of a line. A quoted field may still hold a newline, so a CSV
+// record can cross into the next chunk; validation deals with that.
 typedef struct {
     long start_offset;
     long size;
     int id;
 } Chunk;
 
+// Lines of one chunk, indexed by Chunk.id. Splicing segments in id order
+// restores file order no matter which thread processed which chunk.
+typedef struct {
+    Node *head;
+    Node *tail;
+    atomic_int done;        // Set once the chunk's list is complete
+
+    // Validation as if the chunk started outside quotes, which holds
+    // unless an earlier cut landed inside a quoted field
+    csv_state_t end;        // quote state the chunk leaves off in
+    long bad;               // offset of the first bad line in the chunk, -1 if none
+    atomic_int checked;     // end and bad are set
+} Segment;
+
 // Shared data accessible by all threads
 typedef struct {
     char *filepath;
@@ -27,34 +53,156 @@ typedef struct {
     int total_chunks;       // m
     
     // Thread synchronization
-    int current_chunk_idx;  // Index of the next chunk to be picked up
-    pthread_mutex_t mutex;  // Protects current_chunk_idx
-    
+    dispenser_t next_chunk; // Hands out chunk indices with atomic_fetch_add
+
+    int expected_commas;    // Taken from the header line
+
+    // Output (Stage 5)
+    Segment *segments;      // One per chunk
+    int stream;             // Print segments as soon as all earlier ones are done
+    atomic_int next_to_print; // First segment not printed yet, only advanced under print_mutex
+    csv_state_t print_state;  // Real quote state at next_to_print, under print_mutex
+    pthread_mutex_t print_mutex;
+
     // Error handling flags
-    volatile int error_flag; // 0 = OK, 1 = Error encountered
-    
+    atomic_int error_flag;  // 0 = OK, 1 = an invalid line was found, stop early
+
 } SharedContext;
 
 // Argument struct to pass to each worker thread
 typedef struct {
+    thread_stats_t stats; // Padded per-thread counters, keep first
     int thread_id;
     SharedContext *ctx;
-    Node *head; // The head of the linked list for this specific thread
+    arena_t arena; // Slabs holding this thread's Nodes and line text
 } ThreadArgs;
 
 
 // --- Helper Functions ---
 
 // Function to add a line to a local linked list
-void add_line_to_list(Node **head, char *text) {
-    // TODO: Implement logic to append 'text' to the linked list
-    // Hint: Malloc a new Node, strdup the text, link it.
+void add_line_to_list(arena_t *arena, Node **head, Node **tail, const char *text, size_t len) {
+    Node *node = arena_alloc(arena, sizeof(Node));
+    if (!node || !(node->line = arena_strndup(arena, text, len))) {
+        perror("arena_alloc");
+        exit(1);
+    }
+    node->next = NULL;
+    if (*head == NULL)
+        *head = node;
+    else
+        (*tail)->next = node;
+    *tail = node;
+}
+
+void print_list(Node *head) {
+    for (; head; head = head->next)
+        fputs(head->line, stdout);
+}
+
+// Marks a segment finished and, in streaming mode, prints every segment
+// whose predecessors are all done. Whoever holds print_mutex prints; a
+// thread that finds it taken leaves its segment to the holder, which
+// re-checks after unlocking so nothing is left behind.
+//
+// Printing carries the real quote state, so a segment goes out only
+// when it starts clean and its own validation found no bad line. The
+// first one that does not is held back with everything after it: main
+// prints the rest once first_invalid_line has settled it.
+void finish_segment(SharedContext *ctx, int id) {
+    atomic_store(&ctx->segments[id].done, 1);
+    if (!ctx->stream)
+        return;
+    while (pthread_mutex_trylock(&ctx->print_mutex) == 0) {
+        int next = atomic_load(&ctx->next_to_print), held = 0;
+        while (next < ctx->total_chunks && atomic_load(&ctx->segments[next].done)) {
+            Segment *seg = &ctx->segments[next];
+            if (!csv_state_clean(&ctx->print_state) || seg->bad >= 0) {
+                held = 1;
+                break;
+            }
+            ctx->print_state = seg->end;
+            print_list(seg->head);
+            next++;
+        }
+        fflush(stdout);
+        atomic_store(&ctx->next_to_print, next);
+        pthread_mutex_unlock(&ctx->print_mutex);
+        if (held || next == ctx->total_chunks || !atomic_load(&ctx->segments[next].done))
+            break;
+    }
 }
 
-// Function to check comma consistency
+// Function to check comma consistency of a single line.
+// Workers validate whole chunks with csv_validate_chunk instead.
 int validate_line(char *line, int expected_commas) {
-    // TODO: Return 1 if valid, 0 if invalid
-    return 1; 
+    return csv_validate_chunk(line, strlen(line), expected_commas) < 0;
+}
+
+
+// A bad line in chunk id is certainly real once every earlier chunk is
+// checked and their quotes pair up: the chunk then starts outside quotes.
+int starts_clean(SharedContext *ctx, int id) {
+    int in_quotes = 0;
+    for (int i = 0; i < id; i++) {
+        if (!atomic_load(&ctx->segments[i].checked))
+            return 0;
+        in_quotes ^= ctx->segments[i].end.in_quotes;
+    }
+    return !in_quotes;
+}
+
+// After all threads stopped: walks the chunks in file order carrying the
+// real quote state, re-validates the chunks that start inside a quoted
+// field and returns the file offset of the first invalid line, or -1.
+long first_invalid_line(SharedContext *ctx) {
+    csv_state_t st = {0, 0, 0};
+    char *buf = NULL;
+    long off = -1;
+    int fd = -1;
+
+    for (int i = 0; i < ctx->total_chunks; i++) {
+        Segment *seg = &ctx->segments[i];
+        Chunk *c = &ctx->chunks[i];
+        if (!atomic_load(&seg->checked))
+            break; // skipped after an error that starts_clean proved real, so an error is found before this
+        if (csv_state_clean(&st)) {
+            if (seg->bad >= 0) {
+                off = c->start_offset + seg->bad;
+                break;
+            }
+            st = seg->end;
+            continue;
+        }
+
+        if (fd < 0 && (fd = open(ctx->filepath, O_RDONLY)) < 0) {
+            perror("open");
+            exit(1);
+        }
+        if (!(buf = realloc(buf, c->size ? c->size : 1))) {
+            perror("realloc");
+            exit(1);
+        }
+        for (long got = 0; got < c->size;) {
+            ssize_t r = pread(fd, buf + got, c->size - got, c->start_offset + got);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0) {
+                perror("pread");
+                exit(1);
+            }
+            got += r;
+        }
+        long bad;
+        if (csv_validate_resume(buf, c->size, ctx->expected_commas, &st, i == ctx->total_chunks - 1, &bad)) {
+            off = c->start_offset + bad;
+            break;
+        }
+    }
+    free(buf);
+    if (fd >= 0)
+        close(fd);
+    return off;
 }
 
 
@@ -66,67 +214,147 @@ void* worker_routine(void *arg) {
 
     printf("Thread %d started.\n", args->thread_id); // Stage 1 requirement
 
-    while (1) {
-        Chunk current_task;
-        int task_found = 0;
+    int fd = open(ctx->filepath, O_RDONLY); // one handle per thread, reused with pread
+    if (fd < 0) {
+        perror("Thread failed to open file");
+        exit(1);
+    }
+    char *buf = NULL;
+    long buf_cap = 0;
 
-        // --- Critical Section: Get Task ---
-        pthread_mutex_lock(&ctx->mutex);
-        
-        // Check if we should stop due to error in another thread
-        if (ctx->error_flag) {
-            pthread_mutex_unlock(&ctx->mutex);
-            break; 
+    long first = 0;
+    int taken = 0, next = 0;
+    while (1) {
+        // --- Get Task: refill the local batch with one atomic fetch ---
+        if (next == taken) {
+            taken = dispenser_take(&ctx->next_chunk, &first);
+            next = 0;
+            if (!taken)
+                break; // No more chunks, exit loop
+            args->stats.grabs++;
         }
 
-        // Check if there are tasks left
-        if (ctx->current_chunk_idx < ctx->total_chunks) {
-            current_task = ctx->chunks[ctx->current_chunk_idx];
-            ctx->current_chunk_idx++;
-            task_found = 1;
-        }
-        
-        pthread_mutex_unlock(&ctx->mutex);
-        // --- End Critical Section ---
+        // Check if we should stop due to error in another thread
+        if (atomic_load_explicit(&ctx->error_flag, memory_order_relaxed))
+            break;
 
-        if (!task_found) {
-            break; // No more chunks, exit loop
-        }
+        Chunk current_task = ctx->chunks[first + next++];
+        args->stats.chunks++;
 
         // --- Process Chunk (Stage 2 & 3) ---
         // printf("Thread %d processing chunk starting at %ld, size %ld\n", args->thread_id, current_task.start_offset, current_task.size);
 
-        // TODO: Open file (use fopen or open), fseek/lseek to start_offset.
-        // TODO: Read lines until size is consumed.
-        // TODO: Handle edge cases (lines spanning across chunks).
-        
-        
-        // --- Error Handling (Stage 4) ---
-        // If error detected:
-        // 1. Lock mutex.
-        // 2. Set ctx->error_flag = 1.
-        // 3. Unlock.
-        // 4. Wait for other threads (barrier or join logic needed here later).
-        // 5. Print to stderr.
-        // 6. exit(1).
+        if (current_task.size > buf_cap) {
+            buf_cap = current_task.size;
+            if (!(buf = realloc(buf, buf_cap))) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        long got = 0;
+        while (got < current_task.size) {
+            ssize_t r = pread(fd, buf + got, current_task.size - got, current_task.start_offset + got);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0) {
+                perror("pread");
+                exit(1);
+            }
+            got += r;
+        }
+
+        // --- Validate the whole chunk in one vectorized pass (Stage 3) ---
+        Segment *seg = &ctx->segments[current_task.id];
+        csv_state_t st = {0, 0, 0};
+        int last = current_task.id == ctx->total_chunks - 1;
+        if (!csv_validate_resume(buf, got, ctx->expected_commas, &st, last, &seg->bad))
+            seg->bad = -1;
+        seg->end = st;
+        atomic_store(&seg->checked, 1);
+        if (seg->bad >= 0 && starts_clean(ctx, current_task.id)) {
+            // --- Error Handling (Stage 4) ---
+            // The error is real, so everyone can stop: the others see
+            // the flag or an empty dispenser. main finds the first
+            // invalid line in file order after joining all threads.
+            int expected = 0;
+            if (atomic_compare_exchange_strong(&ctx->error_flag, &expected, 1))
+                dispenser_drain(&ctx->next_chunk);
+            break;
+        }
+        // Otherwise the chunk may start inside a quoted field and the
+        // error may not be real; main re-checks it in file order.
+
+        // The chunk ends on a line boundary, so every line is complete.
+        char *p = buf, *end = buf + got;
+        while (p < end) {
+            char *nl = memchr(p, '\n', end - p);
+            char *next = nl ? nl + 1 : end;
+            add_line_to_list(&args->arena, &seg->head, &seg->tail, p, next - p);
+            args->stats.lines++;
+            p = next;
+        }
+        args->stats.bytes += got;
+        finish_segment(ctx, current_task.id);
     }
 
+    free(buf);
+    close(fd);
     // printf("Thread %d finished.\n", args->thread_id);
-    return NULL; // Return the head of the list if needed, or store in args
+    return NULL; // Lines are left in ctx->segments
 }
 
 
 // --- Main ---
 
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-c <chunk size>] <n threads> <m chunks> <path>\n", name);
+    fprintf(stderr, "       %s -c <chunk size> <n threads> <path>\n", name);
+    fprintf(stderr, "  -c, --chunk-bytes SIZE  target chunk size (e.g. 512K, 8M) instead of m chunks\n");
+    fprintf(stderr, "  -k, --batch K           take K chunks per dispenser fetch (default 1)\n");
+    fprintf(stderr, "  -s, --stats             print per-thread counters to stderr\n");
+    fprintf(stderr, "  -S, --stream            print chunks in file order while later ones are still parsed\n");
+    exit(1);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <n threads> <m chunks> <path>\n", argv[0]);
-        return 1;
+    static const struct option long_opts[] = {
+        {"chunk-bytes", required_argument, NULL, 'c'},
+        {"batch", required_argument, NULL, 'k'},
+        {"stats", no_argument, NULL, 's'},
+        {"stream", no_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0}
+    };
+    long chunk_bytes = 0;
+    int batch = 1, print_stats = 0, stream = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:k:sS", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'S':
+                stream = 1;
+                break;
+            case 'k':
+                if ((batch = atoi(optarg)) <= 0)
+                    usage(argv[0]);
+                break;
+            case 's':
+                print_stats = 1;
+                break;
+            case 'c':
+                if ((chunk_bytes = parse_size(optarg)) < 0)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
     }
+    if (argc - optind != (chunk_bytes ? 2 : 3))
+        usage(argv[0]);
 
-    int n = atoi(argv[1]);
-    int m = atoi(argv[2]);
-    char *path = argv[3];
+    int n = atoi(argv[optind]);
+    int m = chunk_bytes ? 0 : atoi(argv[optind + 1]);
+    char *path = argv[argc - 1];
+    if (n <= 0 || (!chunk_bytes && m <= 0))
+        usage(argv[0]);
 
     // 1. Read Header and File Size
     FILE *fp = fopen(path, "r");
@@ -147,40 +375,51 @@ int main(int argc, char *argv[]) {
     stat(path, &st);
     long total_size = st.st_size;
     long data_start_pos = ftell(fp); // Where data actually starts after header
-    long data_size = total_size - data_start_pos;
+
+    // 2. Divide file into chunks that start and end on line boundaries (Stage 1/2)
+    long *bounds;
+    m = plan_chunks(fileno(fp), data_start_pos, total_size, m, chunk_bytes, &bounds);
+    if (m < 0) {
+        perror("Error planning chunks");
+        return 1;
+    }
 
     fclose(fp); // Close here, threads will open their own handles or use pread
 
-    // 2. Divide file into m chunks (Stage 1/2)
     SharedContext ctx;
     ctx.filepath = path;
     ctx.total_chunks = m;
-    ctx.current_chunk_idx = 0;
-    ctx.error_flag = 0;
-    ctx.chunks = malloc(sizeof(Chunk) * m);
-    pthread_mutex_init(&ctx.mutex, NULL);
+    dispenser_init(&ctx.next_chunk, m, batch);
+    ctx.expected_commas = csv_count_commas(header_buffer, strlen(header_buffer));
+    atomic_init(&ctx.error_flag, 0);
+    ctx.chunks = malloc(sizeof(Chunk) * (m ? m : 1));
+    ctx.segments = calloc(m ? m : 1, sizeof(Segment));
+    if (!ctx.chunks || !ctx.segments) {
+        perror("malloc");
+        return 1;
+    }
+    ctx.stream = stream;
+    atomic_init(&ctx.next_to_print, 0);
+    ctx.print_state = (csv_state_t){0, 0, 0};
+    pthread_mutex_init(&ctx.print_mutex, NULL);
 
-    long chunk_size = data_size / m;
     for (int i = 0; i < m; i++) {
         ctx.chunks[i].id = i;
-        ctx.chunks[i].start_offset = data_start_pos + (i * chunk_size);
-        // Handle the last chunk taking the remainder
-        if (i == m - 1) {
-             ctx.chunks[i].size = (data_start_pos + data_size) - ctx.chunks[i].start_offset;
-        } else {
-             ctx.chunks[i].size = chunk_size;
-        }
+        ctx.chunks[i].start_offset = bounds[i];
+        ctx.chunks[i].size = bounds[i + 1] - bounds[i];
     }
+    free(bounds);
 
     // 3. Create Thread Pool (Stage 1)
     pthread_t *threads = malloc(sizeof(pthread_t) * n);
-    ThreadArgs *thread_args = malloc(sizeof(ThreadArgs) * n);
+    ThreadArgs *thread_args = aligned_alloc(CACHE_LINE, sizeof(ThreadArgs) * n);
 
     for (int i = 0; i < n; i++) {
+        memset(&thread_args[i], 0, sizeof(ThreadArgs));
         thread_args[i].thread_id = i;
         thread_args[i].ctx = &ctx;
-        thread_args[i].head = NULL;
-        
+        arena_init(&thread_args[i].arena);
+
         if (pthread_create(&threads[i], NULL, worker_routine, &thread_args[i]) != 0) {
             perror("Failed to create thread");
             return 1;
@@ -192,12 +431,52 @@ int main(int argc, char *argv[]) {
         pthread_join(threads[i], NULL);
     }
 
-    // 5. Concatenate and Print Lists (Stage 5)
-    // TODO: Iterate through thread_args[i].head and link them together
-    // TODO: Print the final list
+    if (print_stats) {
+        for (int i = 0; i < n; i++) {
+            thread_stats_t *st = &thread_args[i].stats;
+            fprintf(stderr, "Thread %d: chunks=%ld grabs=%ld lines=%ld bytes=%ld\n",
+                    i, st->chunks, st->grabs, st->lines, st->bytes);
+        }
+    }
 
-    // Cleanup
-    pthread_mutex_destroy(&ctx.mutex);
+    // Stage 4: all threads have stopped, report the first invalid line
+    long error_offset = first_invalid_line(&ctx);
+    if (error_offset >= 0) {
+        char line[1024] = "";
+        FILE *err_fp = fopen(path, "r");
+        if (err_fp && fseek(err_fp, error_offset, SEEK_SET) == 0 && fgets(line, sizeof(line), err_fp))
+            line[strcspn(line, "\n")] = '\0';
+        if (err_fp)
+            fclose(err_fp);
+        fprintf(stderr, "Invalid line at offset %ld (expected %d commas): %s\n",
+                error_offset, ctx.expected_commas, line);
+        exit(1);
+    }
+
+    // 5. Concatenate and Print Lists (Stage 5)
+    // Segments are spliced in chunk order: O(m) pointer updates, file order kept.
+    // Streaming mode has printed everything before next_to_print already.
+    Node *head = NULL, *tail = NULL;
+    for (int i = stream ? atomic_load(&ctx.next_to_print) : 0; i < m; i++) {
+        Segment *seg = &ctx.segments[i];
+        if (!seg->head)
+            continue;
+        if (tail)
+            tail->next = seg->head;
+        else
+            head = seg->head;
+        tail = seg->tail;
+    }
+    print_list(head);
+
+    // Cleanup: the lists are freed slab by slab, not node by node
+    arena_t lines;
+    arena_init(&lines);
+    for (int i = 0; i < n; i++)
+        arena_adopt(&lines, &thread_args[i].arena);
+    arena_free(&lines);
+    pthread_mutex_destroy(&ctx.print_mutex);
+    free(ctx.segments);
     free(ctx.chunks);
     free(threads);
     free(thread_args);
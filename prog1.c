@@ -1,5 +1,8 @@
 #define _GNU_SOURCE
 #include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <math.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -8,12 +11,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include "arena.h"
+#include "chunk_plan.h"
+#include "csv_validate.h"
+#include "dispenser.h"
+#include "uring.h"
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
 
 
 typedef struct Node{
-    char* line;
+    const char* line;   // copy in the thread's arena, or a slice of the mapping with -M
+    size_t len;         // bytes in line, trailing '\n' included
     struct Node* next;
 } Node;
 typedef struct{
@@ -21,25 +32,108 @@ typedef struct{
     long size;
     int id;
 } chunk_t;
+// How workers get chunk bytes, picked with --io
+typedef enum{
+    IO_STDIO,   // fseek + getline on a per-thread FILE
+    IO_PREAD,   // pread on the shared fd into a per-thread reusable buffer
+    IO_URING,   // io_uring reads queued ahead of the parser
+    IO_MMAP,    // slices of the mapping, no copies
+} io_backend_t;
+
+static const char* const io_names[] = {"stdio", "pread", "uring", "mmap"};
+
 typedef struct{
     chunk_t* chunks;
     int total_chunks;
-    int current_chunk_idx;
-    pthread_mutex_t mutex;
+    dispenser_t next_chunk;
     char* filepath;
+    io_backend_t io;
+    int fd;             // shared by the pread and uring backends
+    int queue_depth;    // reads each uring worker keeps in flight
+    const char* map;    // whole file mapped once in main, NULL unless --io mmap
+    size_t map_size;
+    struct pipeline* pipeline; // set in pipeline mode (-P)
+    int n_cols;         // columns in the header, used by --aggregate and --columnar
+    struct batch* batches; // one per chunk with --columnar, indexed by chunk_t.id
 } shared_t;
 
+/*
+ * Per-column accumulator for --aggregate. Every worker owns one per
+ * column and they are merged once after pthread_join. Distinct values
+ * are estimated with a HyperLogLog sketch of HLL_REGISTERS registers.
+ */
+#define HLL_BITS 10
+#define HLL_REGISTERS (1 << HLL_BITS)
+#define AGG_NUM_MAX 64  // longer fields are never treated as numbers
+
 typedef struct{
+    long count;         // non-empty fields
+    long numeric;       // fields that parsed as numbers
+    double sum;
+    double min;
+    double max;
+    unsigned char hll[HLL_REGISTERS];
+} col_agg_t;
+
+/*
+ * Columnar form of a chunk for --columnar (struct of arrays). All field
+ * bytes of a batch sit in one buffer, column after column; column c of
+ * row r is bytes + cols[c].base + [offsets[r], offsets[r+1]). Columns in
+ * which every field is a number also get a typed array, so later scans
+ * read one dense array instead of chasing Node pointers.
+ */
+typedef enum{ COL_TEXT, COL_INT, COL_DOUBLE, COL_NULL } col_type_t; // COL_NULL: every field empty
+
+typedef struct{
+    col_type_t type;
+    size_t base;        // start of this column in batch_t.bytes
+    uint32_t* offsets;  // rows + 1 entries, relative to base
+    int64_t* ints;      // COL_INT: one value per row
+    double* doubles;    // COL_DOUBLE: one value per row, NaN for empty fields
+} column_t;
+
+typedef struct batch{
+    long rows;
+    char* bytes;
+    column_t* cols;     // shared_t.n_cols of them
+} batch_t;
+
+// Growable per-thread scratch for one column while a chunk is split.
+typedef struct{
+    char* bytes;
+    size_t len;
+    size_t cap;
+    uint32_t* offsets;
+    size_t offsets_cap;
+} col_builder_t;
+
+typedef struct{
+    thread_stats_t stats;   // first, so the aligned array gives each thread its own line
     shared_t *shared;
+    arena_t arena;          // owns this thread's Nodes (and line copies unless mmapped)
     Node *head;
     Node* tail;
+    col_agg_t *agg;         // n_cols accumulators with --aggregate, NULL otherwise
+    col_builder_t *builders; // n_cols builders with --columnar, NULL otherwise
+    long batch_rows;        // rows in the builders so far
+    char *record;           // lines of a record with quoted newlines, until its quotes close
+    size_t record_len;
+    size_t record_cap;
+    int in_quotes;          // the lines so far end inside a quoted field
+    long batch_first;       // chunks claimed from the dispenser but not started yet
+    int batch_taken;
+    int batch_next;
 } thread_arg_t;
 
-void add_line(thread_arg_t *arg, char* line_content)
+void add_line(thread_arg_t *arg, const char* line_content, size_t len)
 {
-    Node *new_node = malloc(sizeof(Node));
+    Node *new_node = arena_alloc(&arg->arena, sizeof(Node));
+    if (!new_node) ERR("arena_alloc");
     new_node->line = line_content;
+    new_node->len = len;
     new_node->next = NULL;
+    arg->stats.lines++;
+    arg->stats.bytes += len;
     if (arg->head == NULL) {
         arg->head = new_node;
         arg->tail = new_node;
@@ -48,74 +142,843 @@ void add_line(thread_arg_t *arg, char* line_content)
         arg->tail = new_node;
     }
 }
-void* thread_work(void* args)
-{   
-    thread_arg_t* t_arg = (thread_arg_t*)args;
-    shared_t* shared = t_arg->shared;
-    while(1)
-    {
-        int my_task_id = -1;
-        pthread_mutex_lock(&shared->mutex);
-        if(shared->current_chunk_idx<shared->total_chunks)
-        {
-            my_task_id = shared->current_chunk_idx;
-            shared->current_chunk_idx++;
+// Appends a thread's list to the final one and takes over its arena wholesale.
+void adopt_lines(thread_arg_t *final, thread_arg_t *arg)
+{
+    if (arg->head) {
+        if (final->head) final->tail->next = arg->head;
+        else final->head = arg->head;
+        final->tail = arg->tail;
+    }
+    arena_adopt(&final->arena, &arg->arena);
+    arg->head = arg->tail = NULL;
+}
+
+uint64_t hash_field(const char *p, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a, then a murmur finalizer to spread the bits
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)p[i]) * 0x100000001b3ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+void agg_field(col_agg_t *col, const char *p, size_t len)
+{
+    while (len && (*p == ' ' || *p == '\t')) { p++; len--; }
+    while (len && (p[len-1] == ' ' || p[len-1] == '\t' || p[len-1] == '\r')) len--;
+    if (len >= 2 && p[0] == '"' && p[len-1] == '"') { p++; len -= 2; }
+    if (!len) return;
+    col->count++;
+
+    uint64_t h = hash_field(p, len);
+    unsigned reg = h >> (64 - HLL_BITS);
+    uint64_t rest = h << HLL_BITS;
+    unsigned char rank = rest ? __builtin_clzll(rest) + 1 : 64 - HLL_BITS + 1;
+    if (rank > col->hll[reg]) col->hll[reg] = rank;
 
+    if (len < AGG_NUM_MAX) {
+        char num[AGG_NUM_MAX], *end;
+        memcpy(num, p, len);
+        num[len] = '\0';
+        double v = strtod(num, &end);
+        if (end == num + len) {
+            if (!col->numeric || v < col->min) col->min = v;
+            if (!col->numeric || v > col->max) col->max = v;
+            col->sum += v;
+            col->numeric++;
         }
-        pthread_mutex_unlock(&shared->mutex);
-        if(my_task_id==-1)
-        {
-            break; // queue is empty??? THE FUCK DOES THIS MEAN TODO
-        }
-        chunk_t task = shared->chunks[my_task_id];
-
-        FILE *fp = fopen(shared->filepath, "r");
-        if (!fp) ERR("Thread failed to open file");
-        if (task.id == 0) {
-            // First chunk starts immediately
-            fseek(fp, task.start, SEEK_SET);
-        } else {
-            // Check byte BEFORE our start to see if we are in middle of line
-            fseek(fp, task.start - 1, SEEK_SET);
-            int prev_char = fgetc(fp);
-            
-            if (prev_char != '\n') {
-                char c;
-                while ((c = fgetc(fp)) != '\n' && c != EOF);
-            }   
-        }
-
-        char *buffer = NULL;
-        size_t len = 0;
+    }
+}
+
+// Splits one row on unquoted commas straight into the accumulators, nothing is stored.
+void aggregate_line(thread_arg_t *t_arg, const char *line, size_t len)
+{
+    int n_cols = t_arg->shared->n_cols, col = 0, quoted = 0;
+    size_t start = 0;
+    if (len && line[len-1] == '\n') len--;
+    for (size_t i = 0; i < len && col < n_cols; i++) {
+        if (line[i] == '"') quoted = !quoted;
+        else if (line[i] == ',' && !quoted) {
+            agg_field(&t_arg->agg[col++], line + start, i - start);
+            start = i + 1;
+        }
+    }
+    if (col < n_cols) agg_field(&t_arg->agg[col], line + start, len - start);
+    t_arg->stats.lines++;
+    t_arg->stats.bytes += len;
+}
+
+void merge_agg(col_agg_t *into, const col_agg_t *from)
+{
+    if (from->numeric) {
+        if (!into->numeric || from->min < into->min) into->min = from->min;
+        if (!into->numeric || from->max > into->max) into->max = from->max;
+    }
+    into->count += from->count;
+    into->numeric += from->numeric;
+    into->sum += from->sum;
+    for (int i = 0; i < HLL_REGISTERS; i++)
+        if (from->hll[i] > into->hll[i]) into->hll[i] = from->hll[i];
+}
+
+double hll_estimate(const col_agg_t *col)
+{
+    double m = HLL_REGISTERS, sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        sum += ldexp(1.0, -col->hll[i]);
+        zeros += !col->hll[i];
+    }
+    double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (e <= 2.5 * m && zeros) e = m * log(m / zeros); // linear counting for small sets
+    return e;
+}
+
+// Prints one row per header column; names come from the header line.
+void print_agg(const char *header, const col_agg_t *cols, int n_cols)
+{
+    printf("%-20s %12s %12s %16s %14s %14s %14s %12s\n",
+           "column", "count", "numeric", "sum", "min", "max", "mean", "distinct~");
+    const char *p = header;
+    for (int i = 0; i < n_cols; i++) {
+        p += strspn(p, " \t");
+        size_t len = strcspn(p, ",\r\n");
+        const col_agg_t *c = &cols[i];
+        printf("%-20.*s %12ld %12ld", (int)len, p, c->count, c->numeric);
+        if (c->numeric)
+            printf(" %16.6g %14.6g %14.6g %14.6g", c->sum, c->min, c->max, c->sum / c->numeric);
+        else
+            printf(" %16s %14s %14s %14s", "-", "-", "-", "-");
+        printf(" %12.0f\n", hll_estimate(c));
+        p += len;
+        if (*p == ',') p++;
+    }
+}
+
+void builder_push(col_builder_t *b, long row, const char *p, size_t len)
+{
+    if (b->len + len > b->cap) {
+        b->cap = 2 * (b->len + len);
+        if (!(b->bytes = realloc(b->bytes, b->cap))) ERR("realloc");
+    }
+    if ((size_t)row + 2 > b->offsets_cap) {
+        b->offsets_cap = 2 * (row + 2);
+        if (!(b->offsets = realloc(b->offsets, sizeof(uint32_t) * b->offsets_cap))) ERR("realloc");
+    }
+    if (len) memcpy(b->bytes + b->len, p, len);  // bytes stays NULL until a field has any
+    b->len += len;
+    b->offsets[row + 1] = b->len;
+}
+
+void columnar_line(thread_arg_t *t_arg, const char *line, size_t len)
+{
+    int n_cols = t_arg->shared->n_cols, col = 0, quoted = 0;
+    long row = t_arg->batch_rows++;
+    size_t start = 0;
+    if (len && line[len-1] == '\n') len--;
+    if (len && line[len-1] == '\r') len--;
+    for (size_t i = 0; i < len && col < n_cols; i++) {
+        if (line[i] == '"') quoted = !quoted;
+        else if (line[i] == ',' && !quoted) {
+            builder_push(&t_arg->builders[col++], row, line + start, i - start);
+            start = i + 1;
+        }
+    }
+    if (col < n_cols) builder_push(&t_arg->builders[col++], row, line + start, len - start);
+    for (; col < n_cols; col++)  // short rows get empty fields
+        builder_push(&t_arg->builders[col], row, line, 0);
+    t_arg->stats.lines++;
+    t_arg->stats.bytes += len;
+}
+
+// Picks the narrowest type that holds every field of the column; COL_NULL when none has a value.
+col_type_t column_type(const char *bytes, const uint32_t *offsets, long rows)
+{
+    col_type_t type = COL_INT;
+    int empty = 0, values = 0;
+    char num[AGG_NUM_MAX], *end;
+    for (long r = 0; r < rows; r++) {
+        size_t len = offsets[r+1] - offsets[r];
+        if (!len) {
+            empty = 1;
+            continue;
+        }
+        values = 1;
+        if (len >= AGG_NUM_MAX) return COL_TEXT;
+        memcpy(num, bytes + offsets[r], len);
+        num[len] = '\0';
+        if (type == COL_INT) {
+            errno = 0;
+            strtoll(num, &end, 10);
+            if (end == num + len && !errno) continue;
+            type = COL_DOUBLE;
+        }
+        strtod(num, &end);
+        if (end != num + len) return COL_TEXT;
+    }
+    if (!values) return COL_NULL;
+    return empty ? COL_DOUBLE : type; // empty fields become NaN
+}
+
+// Freezes the builders into a batch in the thread's arena, in slot shared->batches[id].
+void finish_batch(thread_arg_t *t_arg, int id)
+{
+    int n_cols = t_arg->shared->n_cols;
+    long rows = t_arg->batch_rows;
+    batch_t *batch = &t_arg->shared->batches[id];
+    size_t total = 0;
+    for (int c = 0; c < n_cols; c++) total += t_arg->builders[c].len;
+
+    batch->rows = rows;
+    batch->bytes = arena_alloc(&t_arg->arena, total ? total : 1);
+    batch->cols = arena_alloc(&t_arg->arena, sizeof(column_t) * n_cols);
+    if (!batch->bytes || !batch->cols) ERR("arena_alloc");
+    size_t base = 0;
+    for (int c = 0; c < n_cols; c++) {
+        col_builder_t *b = &t_arg->builders[c];
+        column_t *col = &batch->cols[c];
+        if (!b->offsets) { // nothing pushed yet, e.g. an empty chunk
+            if (!(b->offsets = malloc(sizeof(uint32_t)))) ERR("malloc");
+            b->offsets_cap = 1;
+        }
+        b->offsets[0] = 0;
+
+        memset(col, 0, sizeof(*col));
+        col->base = base;
+        if (b->len) memcpy(batch->bytes + base, b->bytes, b->len);
+        col->offsets = arena_alloc(&t_arg->arena, sizeof(uint32_t) * (rows + 1));
+        if (!col->offsets) ERR("arena_alloc");
+        memcpy(col->offsets, b->offsets, sizeof(uint32_t) * (rows + 1));
+        col->type = column_type(b->bytes, b->offsets, rows);
+
+        char num[AGG_NUM_MAX];
+        if (col->type == COL_INT && !(col->ints = arena_alloc(&t_arg->arena, sizeof(int64_t) * rows))) ERR("arena_alloc");
+        if (col->type == COL_DOUBLE && !(col->doubles = arena_alloc(&t_arg->arena, sizeof(double) * rows))) ERR("arena_alloc");
+        for (long r = 0; (col->type == COL_INT || col->type == COL_DOUBLE) && r < rows; r++) {
+            size_t len = b->offsets[r+1] - b->offsets[r];
+            if (len) memcpy(num, b->bytes + b->offsets[r], len);
+            num[len] = '\0';
+            if (col->type == COL_INT) col->ints[r] = strtoll(num, NULL, 10);
+            else col->doubles[r] = len ? strtod(num, NULL) : NAN;
+        }
+        base += b->len;
+        b->len = 0;
+    }
+    t_arg->batch_rows = 0;
+}
+
+// Example of a later pass over the batches: sequential scans of typed arrays, in file order.
+void print_columnar(const char *header, const shared_t *shared)
+{
+    printf("%-20s %8s %12s %14s %16s\n", "column", "type", "rows", "bytes", "sum");
+    const char *p = header;
+    for (int c = 0; c < shared->n_cols; c++) {
+        p += strspn(p, " \t");
+        size_t name_len = strcspn(p, ",\r\n");
+        long rows = 0, bytes = 0;
+        int64_t isum = 0;
+        double dsum = 0;
+        int types = 0;  // bitmask of col_type_t seen across batches
+        for (int i = 0; i < shared->total_chunks; i++) {
+            const column_t *col = &shared->batches[i].cols[c];
+            long n = shared->batches[i].rows;
+            rows += n;
+            bytes += col->offsets[n];
+            types |= 1 << col->type;
+            if (col->type == COL_INT)
+                for (long r = 0; r < n; r++) isum += col->ints[r];
+            else if (col->type == COL_DOUBLE)
+                for (long r = 0; r < n; r++) dsum += isnan(col->doubles[r]) ? 0 : col->doubles[r];
+        }
+        // empty fields next to ints are NaN, just as within one batch
+        if ((types & (1 << COL_NULL)) && (types & (1 << COL_INT))) types |= 1 << COL_DOUBLE;
+        const char *type = types & (1 << COL_TEXT) ? "text" : types & (1 << COL_DOUBLE) ? "double" :
+                           types & (1 << COL_INT) ? "int" : "null";
+        printf("%-20.*s %8s %12ld %14ld", (int)name_len, p, type, rows, bytes);
+        if (types & (1 << COL_TEXT) || types == 1 << COL_NULL) printf(" %16s\n", "-");
+        else printf(" %16.6g\n", dsum + (double)isum);
+        p += name_len;
+        if (*p == ',') p++;
+    }
+}
+
+void record_done(thread_arg_t *t_arg, const char *record, size_t len)
+{
+    if (t_arg->builders) columnar_line(t_arg, record, len);
+    else aggregate_line(t_arg, record, len);
+}
+
+/*
+ * A record ends at the first '\n' outside quotes, so the quote state is
+ * carried from line to line. Lines of a record that spans several are
+ * gathered in t_arg->record; every other line goes straight through.
+ */
+void record_line(thread_arg_t *t_arg, const char *line, size_t len)
+{
+    int in_quotes = t_arg->in_quotes;
+    for (const char *q = line; (q = memchr(q, '"', line + len - q)); q++)
+        in_quotes = !in_quotes;
+    if (!t_arg->in_quotes && !in_quotes) {
+        record_done(t_arg, line, len);
+        return;
+    }
+    if (t_arg->record_len + len > t_arg->record_cap) {
+        t_arg->record_cap = 2 * (t_arg->record_len + len);
+        if (!(t_arg->record = realloc(t_arg->record, t_arg->record_cap))) ERR("realloc");
+    }
+    memcpy(t_arg->record + t_arg->record_len, line, len);
+    t_arg->record_len += len;
+    t_arg->in_quotes = in_quotes;
+    if (!in_quotes) {
+        record_done(t_arg, t_arg->record, t_arg->record_len);
+        t_arg->record_len = 0;
+    }
+}
+
+// Aggregates or columnizes whole records, or stores the line; stable lines (mmap) are kept as slices.
+void emit_line(thread_arg_t *t_arg, const char *line, size_t len, int stable)
+{
+    if (t_arg->builders || t_arg->agg) {
+        record_line(t_arg, line, len);
+        return;
+    }
+    if (!stable && !(line = arena_strndup(&t_arg->arena, line, len))) ERR("arena_strndup");
+    add_line(t_arg, line, len);
+}
+
+// Called after the last line of a chunk has gone through emit_line.
+void end_chunk(thread_arg_t *t_arg, const chunk_t *task)
+{
+    // chunks are cut between records, so only an unbalanced quote leaves one open
+    if (t_arg->record_len) {
+        record_done(t_arg, t_arg->record, t_arg->record_len);
+        t_arg->record_len = 0;
+        t_arg->in_quotes = 0;
+    }
+    if (t_arg->builders) finish_batch(t_arg, task->id);
+}
+
+// Page-aligned access hints for the part of the mapping a chunk covers.
+void advise_chunk(const shared_t *shared, const chunk_t *task)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    long from = task->start & ~(page - 1);
+    size_t len = task->start + task->size - from;
+    void *addr = (void*)(shared->map + from);
+
+    // only hints: a kernel or filesystem that turns them down must not end the run
+    int failed = madvise(addr, len, MADV_SEQUENTIAL) != 0;
+    failed |= madvise(addr, len, MADV_WILLNEED) != 0;
+    static atomic_int warned;
+    if (failed && !atomic_exchange(&warned, 1)) perror("madvise, continuing without access hints");
+}
+
+// Zero-copy variant of the chunk loop: lines are slices of the mapping.
+void map_chunk_lines(thread_arg_t *t_arg, const chunk_t *task)
+{
+    const shared_t *shared = t_arg->shared;
+    const char *end = shared->map + shared->map_size;
+    const char *p = shared->map + task->start;
+    const char *limit = p + task->size;
+
+    advise_chunk(shared, task);
+    while (p < limit) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *next = nl ? nl + 1 : end;
+        emit_line(t_arg, p, next - p, 1);
+        p = next;
+    }
+    end_chunk(t_arg, task);
+}
+
+// Next chunk for this thread, refilling the local batch from the dispenser; 0 when drained.
+int next_task(thread_arg_t *t_arg, chunk_t *task)
+{
+    if (t_arg->batch_next == t_arg->batch_taken) {
+        t_arg->batch_taken = dispenser_take(&t_arg->shared->next_chunk, &t_arg->batch_first);
+        t_arg->batch_next = 0;
+        if (!t_arg->batch_taken) return 0;
+        t_arg->stats.grabs++;
+    }
+    *task = t_arg->shared->chunks[t_arg->batch_first + t_arg->batch_next++];
+    t_arg->stats.chunks++;
+    return 1;
+}
+
+// Hands the lines of a chunk buffer on; the buffer gets reused, so stored lines are copied.
+void buffer_chunk_lines(thread_arg_t *t_arg, const chunk_t *task, const char *buf)
+{
+    const char *p = buf, *end = buf + task->size;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *next = nl ? nl + 1 : end;
+        emit_line(t_arg, p, next - p, 0);
+        p = next;
+    }
+    end_chunk(t_arg, task);
+}
+
+void grow_buffer(char **buf, long *cap, long size)
+{
+    if (size <= *cap) return;
+    *cap = size;
+    if (!(*buf = realloc(*buf, *cap))) ERR("realloc");
+}
+
+void stdio_chunks(thread_arg_t *t_arg)
+{
+    FILE *fp = fopen(t_arg->shared->filepath, "r");
+    if (!fp) ERR("Thread failed to open file");
+    char *buffer = NULL;    // getline buffer reused for every row
+    size_t len = 0;
+    chunk_t task;
+    while (next_task(t_arg, &task)) {
+        // chunks are planned on line boundaries, no probing needed
+        if (fseek(fp, task.start, SEEK_SET)) ERR("fseek");
+
         long end_limit = task.start + task.size;
         while(ftell(fp)<end_limit)
         {
-            buffer = NULL; 
-            len = 0;
-            
             ssize_t read = getline(&buffer, &len, fp);
-            if (read == -1) {
-                free(buffer); // EOF or error
+            if (read == -1) break; // EOF or error
+            emit_line(t_arg, buffer, read, 0);
+        }
+        end_chunk(t_arg, &task);
+    }
+    free(buffer);
+    if (fclose(fp)) ERR("fclose");
+}
+
+void pread_chunks(thread_arg_t *t_arg)
+{
+    char *buf = NULL;
+    long cap = 0;
+    chunk_t task;
+    while (next_task(t_arg, &task)) {
+        grow_buffer(&buf, &cap, task.size);
+        for (long got = 0; got < task.size;) {
+            ssize_t r = pread(t_arg->shared->fd, buf + got, task.size - got, task.start + got);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) ERR("pread");
+            got += r;
+        }
+        buffer_chunk_lines(t_arg, &task, buf);
+    }
+    free(buf);
+}
+
+typedef struct{
+    chunk_t task;
+    char *buf;
+    long cap;
+    long got;
+} uring_slot_t;
+
+/*
+ * An SQE length is 32 bits and the kernel caps a read below 2G anyway,
+ * so big chunks are read a piece at a time through the short-read path.
+ */
+#define URING_READ_MAX (1L << 30)
+
+// Queues the read of whatever part of the slot's chunk has not arrived yet.
+void uring_read_rest(uring_t *ring, int fd, uring_slot_t *slot, uint64_t user_data)
+{
+    long want = slot->task.size - slot->got;
+    if (want > URING_READ_MAX) want = URING_READ_MAX;
+    if (uring_prep_read(ring, fd, slot->buf + slot->got, (unsigned)want, slot->task.start + slot->got, user_data))
+        ERR("uring_prep_read");
+}
+
+// Keeps up to queue_depth chunk reads in flight and parses whichever lands first.
+void uring_chunks(thread_arg_t *t_arg)
+{
+    shared_t *shared = t_arg->shared;
+    uring_t ring;
+    if (uring_init(&ring, shared->queue_depth)) {
+        perror("io_uring_setup, falling back to pread");
+        pread_chunks(t_arg);
+        return;
+    }
+    uring_slot_t *slots = calloc(shared->queue_depth, sizeof(uring_slot_t));
+    int *free_slots = malloc(sizeof(int) * shared->queue_depth);
+    if (!slots || !free_slots) ERR("malloc");
+    int n_free = shared->queue_depth, in_flight = 0, drained = 0;
+    for (int i = 0; i < n_free; i++) free_slots[i] = i;
+
+    while (1) {
+        while (!drained && n_free > 0) {
+            uring_slot_t *slot = &slots[free_slots[n_free - 1]];
+            if (!next_task(t_arg, &slot->task)) {
+                drained = 1;
                 break;
             }
-            add_line(t_arg, buffer);
+            n_free--;
+            grow_buffer(&slot->buf, &slot->cap, slot->task.size);
+            slot->got = 0;
+            uring_read_rest(&ring, shared->fd, slot, slot - slots);
+            in_flight++;
+        }
+        if (!in_flight) break;
+        if (uring_submit_and_wait(&ring, 1)) ERR("io_uring_enter");
+
+        struct io_uring_cqe cqe;
+        while (uring_peek(&ring, &cqe)) {
+            uring_slot_t *slot = &slots[cqe.user_data];
+            if (cqe.res < 0) {
+                errno = -cqe.res;
+                ERR("io_uring read");
+            }
+            if (cqe.res == 0) {
+                errno = EIO;
+                ERR("io_uring short read");
+            }
+            slot->got += cqe.res;
+            if (slot->got < slot->task.size) {
+                // short or capped read, queue the rest
+                uring_read_rest(&ring, shared->fd, slot, cqe.user_data);
+                continue;
+            }
+            buffer_chunk_lines(t_arg, &slot->task, slot->buf);
+            free_slots[n_free++] = cqe.user_data;
+            in_flight--;
+        }
+    }
+    for (int i = 0; i < shared->queue_depth; i++) free(slots[i].buf);
+    free(slots);
+    free(free_slots);
+    uring_exit(&ring);
+}
+
+void map_chunks(thread_arg_t *t_arg)
+{
+    chunk_t task;
+    while (next_task(t_arg, &task))
+        map_chunk_lines(t_arg, &task);
+}
+
+void* thread_work(void* args)
+{
+    thread_arg_t* t_arg = (thread_arg_t*)args;
+    switch (t_arg->shared->io) {
+        case IO_STDIO: stdio_chunks(t_arg); break;
+        case IO_PREAD: pread_chunks(t_arg); break;
+        case IO_URING: uring_chunks(t_arg); break;
+        case IO_MMAP: map_chunks(t_arg); break;
+    }
+    return NULL;
+}
+/*
+ * Pipeline mode (-P): reader -> N parse/validate workers -> in-order writer.
+ *
+ * The stages pass chunk buffers ("slots") through bounded rings and the
+ * slots are recycled, so memory is n_slots * chunk size no matter how
+ * big the input is. Only the reader touches the file and only the writer
+ * touches stdout.
+ */
+typedef struct{
+    chunk_t task;
+    char* buf;
+    long cap;
+    long lines;
+    long bad;           // offset of the first invalid line in buf, -1 if valid (negative too once the writer redoes it)
+    csv_state_t end;    // quote state buf leaves off in
+} slot_t;
+
+typedef struct{
+    void** items;
+    int cap;
+    int head;
+    int count;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} ring_t;
+
+typedef struct pipeline{
+    int fd;
+    int expected_commas;
+    int n_slots;
+    slot_t* slots;
+    slot_t end;         // reader's end marker on the done ring, end.task.id = chunks issued
+    ring_t free_slots;  // writer -> reader
+    ring_t work;        // reader -> workers, NULL tells a worker to stop
+    ring_t done;        // workers -> writer, any order
+    atomic_int error_flag; // set by the writer
+    long error_offset;  // file offset of the first invalid line
+} pipeline_t;
+
+void ring_init(ring_t* r, int cap)
+{
+    r->items = malloc(sizeof(void*) * cap);
+    if (!r->items) ERR("malloc");
+    r->cap = cap;
+    r->head = r->count = 0;
+    if (pthread_mutex_init(&r->mutex, NULL)) ERR("pthread_mutex_init");
+    if (pthread_cond_init(&r->not_empty, NULL)) ERR("pthread_cond_init");
+    if (pthread_cond_init(&r->not_full, NULL)) ERR("pthread_cond_init");
+}
+
+void ring_destroy(ring_t* r)
+{
+    pthread_mutex_destroy(&r->mutex);
+    pthread_cond_destroy(&r->not_empty);
+    pthread_cond_destroy(&r->not_full);
+    free(r->items);
+}
+
+void ring_push(ring_t* r, void* item)
+{
+    pthread_mutex_lock(&r->mutex);
+    while (r->count == r->cap)
+        pthread_cond_wait(&r->not_full, &r->mutex);
+    r->items[(r->head + r->count++) % r->cap] = item;
+    pthread_cond_signal(&r->not_empty);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+void* ring_pop(ring_t* r)
+{
+    pthread_mutex_lock(&r->mutex);
+    while (r->count == 0)
+        pthread_cond_wait(&r->not_empty, &r->mutex);
+    void* item = r->items[r->head];
+    r->head = (r->head + 1) % r->cap;
+    r->count--;
+    pthread_cond_signal(&r->not_full);
+    pthread_mutex_unlock(&r->mutex);
+    return item;
+}
+
+void* pipeline_read(void* args)
+{
+    thread_arg_t* t_arg = args;
+    shared_t* shared = t_arg->shared;
+    pipeline_t* pl = shared->pipeline;
+    long first;
+    int taken, issued = 0;
+
+    // a single reader keeps reads sequential and in chunk order
+    while (!atomic_load(&pl->error_flag) && (taken = dispenser_take(&shared->next_chunk, &first)) > 0)
+    {
+        t_arg->stats.grabs++;
+        for (int i = 0; i < taken && !atomic_load(&pl->error_flag); i++) {
+            slot_t* slot = ring_pop(&pl->free_slots);
+            slot->task = shared->chunks[first + i];
+            if (slot->task.size > slot->cap) {
+                slot->cap = slot->task.size;
+                if (!(slot->buf = realloc(slot->buf, slot->cap))) ERR("realloc");
+            }
+            for (long got = 0; got < slot->task.size;) {
+                ssize_t r = pread(pl->fd, slot->buf + got, slot->task.size - got, slot->task.start + got);
+                if (r < 0 && errno == EINTR) continue;
+                if (r <= 0) ERR("pread");
+                got += r;
+            }
+            t_arg->stats.chunks++;
+            t_arg->stats.bytes += slot->task.size;
+            ring_push(&pl->work, slot);
+            issued++;
         }
-        fclose(fp);
-        
     }
+    pl->end.task.id = issued;
+    ring_push(&pl->done, &pl->end);
     return NULL;
-    
 }
+
+void* pipeline_work(void* args)
+{
+    thread_arg_t* t_arg = args;
+    pipeline_t* pl = t_arg->shared->pipeline;
+    slot_t* slot;
+
+    while ((slot = ring_pop(&pl->work)) != NULL) {
+        // checked as if the chunk started outside quotes; the writer sees
+        // chunks in file order, so it fixes that up and reports the error
+        int last = slot->task.id == t_arg->shared->total_chunks - 1;
+        slot->end = (csv_state_t){0, 0, 0};
+        if (!csv_validate_resume(slot->buf, slot->task.size, pl->expected_commas, &slot->end, last, &slot->bad))
+            slot->bad = -1;
+        slot->lines = 0;
+        for (const char* p = slot->buf, *end = p + slot->task.size; p < end; slot->lines++) {
+            const char* nl = memchr(p, '\n', end - p);
+            p = nl ? nl + 1 : end;
+        }
+        t_arg->stats.chunks++;
+        t_arg->stats.lines += slot->lines;
+        t_arg->stats.bytes += slot->task.size;
+        ring_push(&pl->done, slot);
+    }
+    return NULL;
+}
+
+void* pipeline_write(void* args)
+{
+    thread_arg_t* t_arg = args;
+    pipeline_t* pl = t_arg->shared->pipeline;
+    // chunks in flight never span more than n_slots ids, so id % n_slots is a free reorder index
+    slot_t** pending = calloc(pl->n_slots, sizeof(slot_t*));
+    if (!pending) ERR("calloc");
+    int next = 0, received = 0, issued = -1;
+    csv_state_t st = {0, 0, 0}; // real quote state at the start of chunk next
+
+    while (issued < 0 || received < issued) {
+        slot_t* slot = ring_pop(&pl->done);
+        if (slot == &pl->end) {
+            issued = slot->task.id;
+            continue;
+        }
+        received++;
+        pending[slot->task.id % pl->n_slots] = slot;
+        while ((slot = pending[next % pl->n_slots]) && slot->task.id == next) {
+            pending[next % pl->n_slots] = NULL;
+            // a cut inside a quoted field leaves a line open: redo the chunk from the real state
+            int failed = slot->bad >= 0;
+            if (csv_state_clean(&st))
+                st = slot->end;
+            else
+                failed = csv_validate_resume(slot->buf, slot->task.size, pl->expected_commas, &st,
+                                             slot->task.id == t_arg->shared->total_chunks - 1, &slot->bad);
+            // the first bad chunk in file order holds the first invalid line; it stops the reader
+            if (failed && !atomic_load(&pl->error_flag)) {
+                pl->error_offset = slot->task.start + slot->bad;
+                atomic_store(&pl->error_flag, 1);
+            }
+            // once any chunk failed validation nothing more is written
+            if (!atomic_load(&pl->error_flag)) {
+                if (fwrite(slot->buf, 1, slot->task.size, stdout) != (size_t)slot->task.size) ERR("fwrite");
+                t_arg->stats.chunks++;
+                t_arg->stats.lines += slot->lines;
+                t_arg->stats.bytes += slot->task.size;
+            }
+            ring_push(&pl->free_slots, slot);
+            next++;
+        }
+    }
+    if (fflush(stdout)) ERR("fflush");
+    free(pending);
+    return NULL;
+}
+
+// Runs the three stages with n workers; returns 0 or -1 if an invalid line stopped it.
+int run_pipeline(shared_t* shared, int n, int expected_commas, thread_arg_t* thread_args)
+{
+    pipeline_t pl = {0};
+    pl.fd = open(shared->filepath, O_RDONLY);
+    if (pl.fd < 0) ERR("open");
+    pl.expected_commas = expected_commas;
+    pl.n_slots = 2 * n + 2; // enough to keep every stage busy
+    pl.slots = calloc(pl.n_slots, sizeof(slot_t));
+    if (!pl.slots) ERR("calloc");
+    atomic_init(&pl.error_flag, 0);
+    ring_init(&pl.free_slots, pl.n_slots);
+    ring_init(&pl.work, pl.n_slots + n);  // room for the n stop markers
+    ring_init(&pl.done, pl.n_slots + 1);  // and for the end marker
+    for (int i = 0; i < pl.n_slots; i++)
+        ring_push(&pl.free_slots, &pl.slots[i]);
+    shared->pipeline = &pl;
+
+    // thread_args[0] is the reader, [1..n] the workers, [n+1] the writer
+    pthread_t* tids = malloc(sizeof(pthread_t) * (n + 2));
+    if (!tids) ERR("malloc");
+    for (int i = 0; i < n + 2; i++) {
+        void* (*stage)(void*) = i == 0 ? pipeline_read : i == n + 1 ? pipeline_write : pipeline_work;
+        if (pthread_create(&tids[i], NULL, stage, &thread_args[i])) ERR("pthread_create");
+    }
+    if (pthread_join(tids[0], NULL)) ERR("pthread_join");
+    for (int i = 0; i < n; i++)
+        ring_push(&pl.work, NULL);
+    for (int i = 1; i < n + 2; i++)
+        if (pthread_join(tids[i], NULL)) ERR("pthread_join");
+
+    int ret = 0;
+    if (atomic_load(&pl.error_flag)) {
+        fprintf(stderr, "Invalid line at offset %ld (expected %d commas)\n", pl.error_offset, expected_commas);
+        ret = -1;
+    }
+    for (int i = 0; i < pl.n_slots; i++)
+        free(pl.slots[i].buf);
+    free(pl.slots);
+    ring_destroy(&pl.free_slots);
+    ring_destroy(&pl.work);
+    ring_destroy(&pl.done);
+    if (close(pl.fd)) ERR("close");
+    shared->pipeline = NULL;
+    free(tids);
+    return ret;
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options] <n threads> <m chunks> <path>\n", name);
+    fprintf(stderr, "       %s [options] -c <size> <n threads> <path>\n", name);
+    fprintf(stderr, "  -i, --io BACKEND        how workers read chunks: stdio (default), pread, uring, mmap\n");
+    fprintf(stderr, "  -q, --queue-depth D     reads each uring worker keeps in flight (default 4)\n");
+    fprintf(stderr, "  -M, --mmap              same as --io mmap: lines are slices of one mapping\n");
+    fprintf(stderr, "  -c, --chunk-bytes SIZE  target chunk size (e.g. 512K, 8M) instead of m chunks\n");
+    fprintf(stderr, "  -k, --batch K           take K chunks per dispenser fetch (default 1)\n");
+    fprintf(stderr, "  -s, --stats             print per-thread counters to stderr\n");
+    fprintf(stderr, "  -a, --aggregate         print per-column count/sum/min/max/mean/distinct instead of\n");
+    fprintf(stderr, "                          keeping lines; workers aggregate into thread-local state\n");
+    fprintf(stderr, "  -C, --columnar          turn every chunk into a columnar batch (offsets + one byte\n");
+    fprintf(stderr, "                          buffer, typed arrays for numeric columns) and summarize them\n");
+    fprintf(stderr, "  -P, --pipeline          stream the file through reader/worker/writer stages with\n");
+    fprintf(stderr, "                          bounded memory, validating and printing lines in order\n");
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv)
 {
-    if(argc!=4){
-        fprintf(stderr, "Usage: %s <n threads> <m chunks> <path>\n", argv[0]);
-        return EXIT_FAILURE;
+    static const struct option long_opts[] = {
+        {"io", required_argument, NULL, 'i'},
+        {"queue-depth", required_argument, NULL, 'q'},
+        {"mmap", no_argument, NULL, 'M'},
+        {"chunk-bytes", required_argument, NULL, 'c'},
+        {"batch", required_argument, NULL, 'k'},
+        {"stats", no_argument, NULL, 's'},
+        {"pipeline", no_argument, NULL, 'P'},
+        {"aggregate", no_argument, NULL, 'a'},
+        {"columnar", no_argument, NULL, 'C'},
+        {NULL, 0, NULL, 0}
+    };
+    io_backend_t io = IO_STDIO;
+    int queue_depth = 4, batch = 1, print_stats = 0, pipeline = 0, aggregate = 0, columnar = 0;
+    long chunk_bytes = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "i:q:Mc:k:sPaC", long_opts, NULL)) != -1) {
+        switch (c) {
+            case 'i':
+                for (io = 0; io <= IO_MMAP && strcmp(optarg, io_names[io]); io++);
+                if (io > IO_MMAP) usage(argv[0]);
+                break;
+            case 'q':
+                if ((queue_depth = atoi(optarg)) <= 0) usage(argv[0]);
+                break;
+            case 'M': io = IO_MMAP; break;
+            case 'P': pipeline = 1; break;
+            case 'a': aggregate = 1; break;
+            case 'C': columnar = 1; break;
+            case 'k':
+                if ((batch = atoi(optarg)) <= 0) usage(argv[0]);
+                break;
+            case 's': print_stats = 1; break;
+            case 'c':
+                if ((chunk_bytes = parse_size(optarg)) < 0) usage(argv[0]);
+                break;
+            default: usage(argv[0]);
+        }
     }
+    if(argc-optind!=(chunk_bytes ? 2 : 3)) usage(argv[0]);
 
-    int n = atoi(argv[1]);
-    int m = atoi(argv[2]);
-    char *path = argv[3];
+    int n = atoi(argv[optind]);
+    int m = chunk_bytes ? 0 : atoi(argv[optind+1]);
+    char *path = argv[argc-1];
+    if (n <= 0 || (!chunk_bytes && m <= 0)) usage(argv[0]);
+    if (pipeline && (io != IO_STDIO || aggregate || columnar)) usage(argv[0]); // the pipeline has its own reader
+    if (aggregate && columnar) usage(argv[0]);
 
     FILE* fp = fopen(path, "r");
     if(!fp){ERR("Error reading file");}
@@ -126,44 +989,116 @@ int main(int argc, char **argv)
     stat(path, &st);
     long total_size = st.st_size;
     long data_start_pos= ftell(fp);
-    long data_size = total_size-data_start_pos;
-    chunk_t * chunks  = malloc(sizeof(chunk_t)*m);
-    pthread_mutex_t mutex;
-    pthread_mutex_init(&mutex, NULL);
-    long chunk_size = data_size/m;
+
+    const char *map = NULL;
+    if (io == IO_MMAP) {
+        map = mmap(NULL, total_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (map == MAP_FAILED) ERR("mmap");
+    }
+
+    long *bounds;
+    m = plan_chunks(fileno(fp), data_start_pos, total_size, m, chunk_bytes, &bounds);
+    if (m < 0) ERR("plan_chunks");
+    // --aggregate and --columnar work on whole records, which must not be split between chunks
+    if ((aggregate || columnar) && (m = snap_to_records(fileno(fp), bounds, m)) < 0) ERR("snap_to_records");
+    chunk_t * chunks  = malloc(sizeof(chunk_t)*(m ? m : 1));
+    if (!chunks) ERR("malloc");
     for(int i=0; i<m; i++)
     {
         chunks[i].id = i;
-        chunks[i].start = data_start_pos + (i*chunk_size);
-        if (i == m - 1) {
-            chunks[i].size = (data_start_pos + data_size) - chunks[i].start;
-        } else {
-            chunks[i].size = chunk_size;
+        chunks[i].start = bounds[i];
+        chunks[i].size = bounds[i+1] - bounds[i];
+        if (columnar && chunks[i].size > UINT32_MAX) {
+            fprintf(stderr, "--columnar needs chunks below 4G, use -c\n");
+            exit(EXIT_FAILURE);
         }
     }
+    free(bounds);
 
     shared_t shared={
         .chunks = chunks,
         .total_chunks = m,
-        .current_chunk_idx = 0,
-        .mutex = mutex,
-        .filepath = path
+        .filepath = path,
+        .io = io,
+        .fd = fileno(fp),
+        .queue_depth = queue_depth,
+        .n_cols = csv_count_commas(header_buffer, strlen(header_buffer)) + 1,
+        .map = map,
+        .map_size = total_size
     };
+    dispenser_init(&shared.next_chunk, m, batch);
+    if (columnar && !(shared.batches = calloc(m ? m : 1, sizeof(batch_t)))) ERR("calloc");
 
+    int n_args = pipeline ? n + 2 : n;
     pthread_t * workers = malloc(sizeof(pthread_t)*n);
-    thread_arg_t *thread_args = malloc(sizeof(thread_arg_t)*n);
+    thread_arg_t *thread_args = aligned_alloc(CACHE_LINE, sizeof(thread_arg_t)*n_args);
+    if (!workers || !thread_args) ERR("malloc");
+    memset(thread_args, 0, sizeof(thread_arg_t)*n_args);
+    for(int i = 0; i < n_args; i++)
+        thread_args[i].shared = &shared;
+
+    if (pipeline) {
+        int ret = run_pipeline(&shared, n, csv_count_commas(header_buffer, strlen(header_buffer)), thread_args);
+        if (print_stats) {
+            for(int i = 0; i < n_args; i++) {
+                thread_stats_t *st = &thread_args[i].stats;
+                const char *role = i == 0 ? "reader" : i == n + 1 ? "writer" : "worker";
+                fprintf(stderr, "%s %d: chunks=%ld lines=%ld bytes=%ld\n",
+                        role, i, st->chunks, st->lines, st->bytes);
+            }
+        }
+        free(thread_args);
+        free(workers);
+        free(chunks);
+        fclose(fp);
+        return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
 
     for(int i = 0; i < n; i++) {
-        thread_args[i].shared = &shared;
-        thread_args[i].head = NULL;
-        thread_args[i].tail = NULL;
-        pthread_create(&workers[i], NULL, thread_work, &thread_args[i]);
+        arena_init(&thread_args[i].arena);
+        if (aggregate && !(thread_args[i].agg = calloc(shared.n_cols, sizeof(col_agg_t)))) ERR("calloc");
+        if (columnar && !(thread_args[i].builders = calloc(shared.n_cols, sizeof(col_builder_t)))) ERR("calloc");
+        if (pthread_create(&workers[i], NULL, thread_work, &thread_args[i])) ERR("pthread_create");
     }
     for(int j=0; j<n; j++)
     {
-        pthread_join(workers[j], NULL);
+        if (pthread_join(workers[j], NULL)) ERR("pthread_join");
+    }
+    if (print_stats) {
+        for(int i = 0; i < n; i++) {
+            thread_stats_t *st = &thread_args[i].stats;
+            fprintf(stderr, "thread %d: chunks=%ld grabs=%ld lines=%ld bytes=%ld\n",
+                    i, st->chunks, st->grabs, st->lines, st->bytes);
+        }
+    }
+    if (aggregate) {
+        // merge once, after every worker is done; no locks on the hot path
+        for(int i = 1; i < n; i++) {
+            for(int j = 0; j < shared.n_cols; j++)
+                merge_agg(&thread_args[0].agg[j], &thread_args[i].agg[j]);
+            free(thread_args[i].agg);
+        }
+        print_agg(header_buffer, thread_args[0].agg, shared.n_cols);
+        free(thread_args[0].agg);
+    }
+    for(int i = 0; i < n; i++)
+        free(thread_args[i].record);
+    if (columnar) {
+        print_columnar(header_buffer, &shared);
+        for(int i = 0; i < n; i++) {
+            for(int j = 0; j < shared.n_cols; j++) {
+                free(thread_args[i].builders[j].bytes);
+                free(thread_args[i].builders[j].offsets);
+            }
+            free(thread_args[i].builders);
+        }
+        free(shared.batches); // the batch contents live in the arenas
     }
-    pthread_mutex_destroy(&mutex);
+    thread_arg_t lines = {0};
+    for(int i = 0; i < n; i++)
+        adopt_lines(&lines, &thread_args[i]);
+    arena_free(&lines.arena);
+    if (map && munmap((void*)map, total_size)) ERR("munmap");
     free(thread_args);
     free(workers);
     free(chunks);
@@ -42,6 +42,18 @@ int read_int_cli()
     return number;
 }
 
+long read_long_cli()
+{
+    long number;
+    int res = scanf("%ld", &number);
+    if (res == EOF)
+        ERR("scanf");
+    if (res == 0)
+        number = 0;
+    getchar();
+    return number;
+}
+
 float read_float_cli()
 {
     float number;
@@ -1,136 +1,1631 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <limits.h>
+#include <linux/mempolicy.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CIRCLE_HAVE_X86 1
+#endif
+
 #include "header.h"
 
 /**
  * Thread pool
+ *
+ * Every worker owns a Chase-Lev deque. Jobs dispatched from inside a
+ * job (e.g. start_monte_carlo fanning out circle_monte_carlo) are pushed
+ * onto the calling worker's deque; jobs from outside the pool go
+ * through a bounded injection queue. An idle worker pops its own deque
+ * (LIFO), then the injection queue, then steals (FIFO) from random
+ * victims. Workers with nothing to do park on a futex eventcount and a
+ * submission wakes at most one of them.
+ */
+
+#define MAX_TASK_WORKERS 16
+#define DEFAULT_QUEUE_CAPACITY 256
+#define DEFAULT_IDLE_TIMEOUT_MS 2000
+#define DEQUE_CAPACITY 1024 // power of two; a full deque spills into the injection queue
+#define CACHE_LINE 64
+
+/*
+ * Jobs from outside the pool wait in one heap ordered by virtual
+ * deadline: a job with an explicit deadline uses it, any other job uses
+ * the time it became runnable plus the offset of its class. So high
+ * beats normal beats background, yet a background job overtakes newer
+ * work once it has waited BACKGROUND_AGING_NS, which is the aging that
+ * keeps it from starving. Once the head of the heap is due (or carries
+ * a deadline) workers take it before their own deque.
+ */
+enum job_priority
+{
+    PRIORITY_HIGH,
+    PRIORITY_NORMAL,
+    PRIORITY_BACKGROUND,
+    PRIORITY_CLASSES,
+};
+
+#define NORMAL_AGING_NS 10000000L      // 10 ms
+#define BACKGROUND_AGING_NS 100000000L // 100 ms
+
+static const long priority_offset_ns[PRIORITY_CLASSES] = {0, NORMAL_AGING_NS, BACKGROUND_AGING_NS};
+static const char *const priority_names[PRIORITY_CLASSES] = {"high", "normal", "background"};
+
+#define TRACE_EVENTS 16384 // per worker; older events are overwritten
+
+/* queue-wait histogram: 16 linear sub-buckets per power of two of nanoseconds */
+#define WAIT_SUB_BITS 4
+#define WAIT_BUCKETS ((64 - WAIT_SUB_BITS) << WAIT_SUB_BITS)
+
+struct thread_pool;
+typedef struct successor successor_t;
+
+/*
+ * A job doubles as its own completion handle. The pool holds one
+ * reference until the job has run, and the handle returned by dispatch
+ * holds another that the caller drops with job_release.
  */
+typedef struct job
+{
+    void (*work_function)(void *);
+    void *work_arg;
+    struct thread_pool *pool;
+
+    enum job_priority priority;
+    long deadline_ns;                  // absolute CLOCK_MONOTONIC, 0 when none
+    long ready_ns;                     // when it became runnable
+    long key;                          // virtual deadline in the injection heap
+
+    atomic_int refs;
+    atomic_int pending;                // unfinished dependencies (+1 while dispatch_after wires them up)
+    atomic_uint done;                  // futex word, set once work_function has returned
+    atomic_int waiters;                // threads blocked in job_wait
+    _Atomic(successor_t *) successors; // jobs waiting on this one, SUCCESSORS_CLOSED once done
+} job_t;
+
+struct successor
+{
+    job_t *job;
+    successor_t *next;
+};
+
+#define SUCCESSORS_CLOSED ((successor_t *)1)
+
+/* Chase-Lev work-stealing deque (fixed size, C11 atomics version of Le et al.) */
+typedef struct deque
+{
+    _Alignas(CACHE_LINE) atomic_long top; // thieves take here
+    _Alignas(CACHE_LINE) atomic_long bottom; // owner pushes and pops here
+    _Atomic(job_t *) buffer[DEQUE_CAPACITY];
+} deque_t;
+
+/* Futex-based eventcount: parking costs nothing unless someone actually sleeps. */
+typedef struct eventcount
+{
+    atomic_uint epoch;
+    atomic_int waiters;
+} eventcount_t;
+
+enum worker_state
+{
+    WORKER_EMPTY,   // slot never used
+    WORKER_RUNNING,
+    WORKER_RETIRED, // thread exited after idling, still to be joined
+};
+
+/*
+ * Counters a worker keeps about itself. Only the owner writes them; the
+ * metrics command reads them while the pool runs, so they are a live
+ * view rather than a consistent snapshot.
+ */
+typedef struct worker_metrics
+{
+    _Alignas(CACHE_LINE) long jobs;
+    long busy_ns;           // running jobs, nested helper jobs not counted twice
+    long idle_ns;           // parked
+    long lock_wait_ns;      // blocked on the injection queue mutex
+    long steal_attempts;
+    long steals;
+    long deque_high_water;
+} worker_metrics_t;
+
+typedef struct trace_event
+{
+    void (*work)(void *);
+    long start_ns;
+    long end_ns;
+} trace_event_t;
+
+typedef struct worker
+{
+    deque_t deque;
+    struct thread_pool *pool;
+    int id;
+    unsigned int seed; // victim selection
+    pthread_t thread;
+    enum worker_state state; // protected by the pool's resize_mtx
+    int cpu;                 // pinned CPU, -1 when not pinned
+    int node;
+    int *victims;            // steal order, same node first
+    int near;                // victims on the same node
+    long wait_hist[PRIORITY_CLASSES][WAIT_BUCKETS]; // queue wait of the jobs this worker ran
+    worker_metrics_t metrics;
+    int depth;                                      // run_job nesting while helping in a wait
+    trace_event_t *trace;                           // TRACE_EVENTS ring, NULL unless tracing
+    unsigned long traced;                           // events ever written to trace
+} worker_t;
+
+/*
+ * The pool keeps between min_size and size workers. It grows by one
+ * thread whenever work is submitted while nobody is parked, and a worker
+ * that stays parked for idle_timeout_ms retires while more than
+ * min_size are alive. Worker slots are allocated for the maximum up
+ * front, so a slot id is stable and a retired slot is simply reused.
+ */
+typedef struct thread_pool
+{
+    int size;              // worker slots, the most threads the pool grows to
+    int min_size;
+    int idle_timeout_ms;
+    worker_t **workers;    // size entries, each mapped on its worker's node
+    int *cpus;             // CPU of each slot, NULL when workers are not pinned
+    const char *trace_path; // Chrome trace written here by cleanup, NULL when not tracing
+    long started_ns;
+    atomic_int live;       // workers in WORKER_RUNNING
+    pthread_mutex_t resize_mtx;
+
+    /* the injection queue and the parking lot get lines of their own */
+    _Alignas(CACHE_LINE) pthread_mutex_t mtx; // protects the injection queue
+    pthread_cond_t  not_full;  // signalled when a job leaves a full queue
+
+    /* bounded min-heap on job->key of jobs submitted from outside the pool, protected by mtx */
+    job_t **queue;
+    int capacity;
+    int count;             // jobs waiting
+    int high_water;        // largest count seen
+    atomic_int queued;     // copy of count that workers can read without the lock
+    atomic_long due_at;    // when the heap head should preempt local work, LONG_MAX when empty
+
+    _Alignas(CACHE_LINE) eventcount_t idle; // workers park here when they find no work
+
+    _Alignas(CACHE_LINE) atomic_int shutdown;
+} thread_pool_t;
+
+/* worker running on this thread, NULL outside the pool */
+static __thread worker_t *current_worker;
+
+static long futex(atomic_uint *addr, int op, unsigned int val)
+{
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+/* Snapshot to pass to ec_wait; re-check for work between the two calls. */
+unsigned int ec_prepare(eventcount_t *ec)
+{
+    unsigned int key = atomic_load(&ec->epoch);
+    atomic_fetch_add(&ec->waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    return key;
+}
+
+void ec_cancel(eventcount_t *ec)
+{
+    atomic_fetch_sub(&ec->waiters, 1);
+}
+
+/* Returns 1 if timeout_ms passed without a notify. */
+int ec_wait(eventcount_t *ec, unsigned int key, int timeout_ms)
+{
+    struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+    int timed_out = 0;
+    if (atomic_load(&ec->epoch) == key)
+        timed_out = syscall(SYS_futex, &ec->epoch, FUTEX_WAIT_PRIVATE, key, &timeout, NULL, 0) == -1 &&
+                    errno == ETIMEDOUT;
+    atomic_fetch_sub(&ec->waiters, 1);
+    return timed_out;
+}
+
+/* Call after publishing work; free when nobody is parked. */
+void ec_notify(eventcount_t *ec, int all)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&ec->waiters) == 0)
+        return;
+    atomic_fetch_add(&ec->epoch, 1);
+    futex(&ec->epoch, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1);
+}
+
+/* Owner only. Returns -1 when the deque is full. */
+int deque_push(deque_t *d, job_t *job)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t >= DEQUE_CAPACITY)
+        return -1;
+    atomic_store_explicit(&d->buffer[b & (DEQUE_CAPACITY - 1)], job, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+/* Owner only, newest job first. */
+job_t *deque_pop(deque_t *d)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (t > b)
+    {
+        /* empty */
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+    job_t *job = atomic_load_explicit(&d->buffer[b & (DEQUE_CAPACITY - 1)], memory_order_relaxed);
+    if (t == b)
+    {
+        /* last job, race the thieves for it */
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst,
+                                                     memory_order_relaxed))
+            job = NULL;
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return job;
+}
+
+/* Any thread, oldest job first. NULL if empty or another thief won. */
+job_t *deque_steal(deque_t *d)
+{
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b)
+        return NULL;
+    job_t *job = atomic_load_explicit(&d->buffer[t & (DEQUE_CAPACITY - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed))
+        return NULL;
+    return job;
+}
+
+/* Owner's view of how many jobs are queued. */
+long deque_size(deque_t *d)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    return b > t ? b - t : 0;
+}
+
+long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Called with mtx held after the heap changed. */
+void queue_publish(thread_pool_t *pool)
+{
+    long due = LONG_MAX;
+    if (pool->count > 0)
+        due = pool->queue[0]->deadline_ns ? 0 : pool->queue[0]->key;
+    atomic_store_explicit(&pool->due_at, due, memory_order_relaxed);
+    atomic_store_explicit(&pool->queued, pool->count, memory_order_relaxed);
+}
+
+job_t *queue_pop(thread_pool_t *pool)
+{
+    if (atomic_load_explicit(&pool->queued, memory_order_relaxed) == 0)
+        return NULL;
+
+    job_t *job = NULL;
+    worker_t *self = current_worker;
+    if (pthread_mutex_trylock(&pool->mtx) != 0)
+    {
+        long start = now_ns();
+        pthread_mutex_lock(&pool->mtx);
+        if (self)
+            self->metrics.lock_wait_ns += now_ns() - start;
+    }
+    if (pool->count > 0)
+    {
+        job_t **heap = pool->queue;
+        job = heap[0];
+        if (pool->count-- == pool->capacity)
+            pthread_cond_signal(&pool->not_full);
+
+        job_t *last = heap[pool->count];
+        int i = 0;
+        for (int child; (child = 2 * i + 1) < pool->count; i = child)
+        {
+            if (child + 1 < pool->count && heap[child + 1]->key < heap[child]->key)
+                child++;
+            if (last->key <= heap[child]->key)
+                break;
+            heap[i] = heap[child];
+        }
+        heap[i] = last;
+        queue_publish(pool);
+    }
+    pthread_mutex_unlock(&pool->mtx);
+    return job;
+}
+
+void queue_push(thread_pool_t *pool, job_t *job)
+{
+    pthread_mutex_lock(&pool->mtx);
+
+    while (pool->count == pool->capacity)
+        pthread_cond_wait(&pool->not_full, &pool->mtx);
+
+    job_t **heap = pool->queue;
+    int i = pool->count++;
+    for (int parent; i > 0 && heap[parent = (i - 1) / 2]->key > job->key; i = parent)
+        heap[i] = heap[parent];
+    heap[i] = job;
+    if (pool->count > pool->high_water)
+        pool->high_water = pool->count;
+    queue_publish(pool);
+
+    pthread_mutex_unlock(&pool->mtx);
+}
+
+int pool_grow(thread_pool_t *pool);
+
+/* 1 when the head of the injection heap should run before local work. */
+int queue_due(thread_pool_t *pool)
+{
+    return atomic_load_explicit(&pool->queued, memory_order_relaxed) > 0 &&
+           atomic_load_explicit(&pool->due_at, memory_order_relaxed) <= now_ns();
+}
+
+/*
+ * A due injected job first, then the own deque, then the rest of the
+ * injection queue, then one pass over the victims.
+ */
+job_t *find_work(worker_t *self)
+{
+    thread_pool_t *pool = self->pool;
+    job_t *job = NULL;
+    if (queue_due(pool))
+        job = queue_pop(pool);
+    if (job || (job = deque_pop(&self->deque)))
+        return job;
+    if ((job = queue_pop(pool)))
+    {
+        /* still backed up and nobody parked: get help before settling into the job */
+        if (atomic_load_explicit(&pool->queued, memory_order_relaxed) > 0 && atomic_load(&pool->idle.waiters) == 0 &&
+            atomic_load(&pool->live) < pool->size)
+            pool_grow(pool);
+        return job;
+    }
+
+    /* victims on our node first, each group from a random start */
+    int far = pool->size - 1 - self->near;
+    unsigned int start = rand_r(&self->seed);
+    for (int i = 0; i < self->near; i++)
+    {
+        worker_t *victim = pool->workers[self->victims[(start + i) % self->near]];
+        self->metrics.steal_attempts++;
+        if ((job = deque_steal(&victim->deque)))
+        {
+            self->metrics.steals++;
+            return job;
+        }
+    }
+    for (int i = 0; i < far; i++)
+    {
+        worker_t *victim = pool->workers[self->victims[self->near + (start + i) % far]];
+        self->metrics.steal_attempts++;
+        if ((job = deque_steal(&victim->deque)))
+        {
+            self->metrics.steals++;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+void submit(thread_pool_t *pool, job_t *job);
+
+void job_release(job_t *job)
+{
+    if (atomic_fetch_sub(&job->refs, 1) == 1)
+        free(job);
+}
+
+/* Marks the job done, wakes its waiters and submits successors that have no other pending dependency. */
+void finish_job(job_t *job)
+{
+    atomic_store(&job->done, 1);
+    if (atomic_load(&job->waiters) > 0)
+        futex(&job->done, FUTEX_WAKE_PRIVATE, INT_MAX);
+
+    successor_t *s = atomic_exchange(&job->successors, SUCCESSORS_CLOSED);
+    while (s)
+    {
+        successor_t *next = s->next;
+        if (atomic_fetch_sub(&s->job->pending, 1) == 1)
+            submit(s->job->pool, s->job);
+        free(s);
+        s = next;
+    }
+    job_release(job);
+}
+
+void record_wait(worker_t *self, job_t *job, long now)
+{
+    unsigned long wait = (unsigned long)(now - job->ready_ns);
+    int bucket = wait;
+    if (wait >= 1UL << WAIT_SUB_BITS)
+    {
+        int msb = 63 - __builtin_clzl(wait);
+        bucket = ((msb - WAIT_SUB_BITS + 1) << WAIT_SUB_BITS) + (int)((wait >> (msb - WAIT_SUB_BITS)) & ((1 << WAIT_SUB_BITS) - 1));
+    }
+    self->wait_hist[job->priority][bucket]++;
+}
+
+/* Only ever called on pool workers. */
+void run_job(job_t *job)
+{
+    worker_t *self = current_worker;
+    long start = now_ns();
+    record_wait(self, job, start);
+
+    self->depth++;
+    job->work_function(job->work_arg);
+    self->depth--;
+
+    long end = now_ns();
+    self->metrics.jobs++;
+    if (self->depth == 0)
+        self->metrics.busy_ns += end - start;
+    if (self->trace)
+        self->trace[self->traced++ % TRACE_EVENTS] = (trace_event_t){job->work_function, start, end};
+
+    finish_job(job);
+}
+
+/**
+ * Placement
+ *
+ * With an affinity policy every worker slot is pinned to one CPU: compact
+ * fills a node core by core (hyperthread siblings together), scatter
+ * spreads consecutive slots over nodes and physical cores first, and a
+ * list such as "0,2,8-11" is used as given. Topology comes from
+ * /sys/devices/system/cpu. Each worker's state, its deque above all, is
+ * mapped separately and bound to the worker's node, and a worker tries
+ * victims on its own node before stealing across nodes.
+ */
+
+typedef struct cpu_info
+{
+    int cpu;
+    int node;
+    int package;
+    int core;
+    int smt;       // rank among the hyperthreads of its core
+    int core_rank; // rank of its core within the node
+} cpu_info_t;
+
+int read_sys_int(const char *fmt, int cpu)
+{
+    char path[128];
+    snprintf(path, sizeof(path), fmt, cpu);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    int value = -1;
+    if (fscanf(f, "%d", &value) != 1)
+        value = -1;
+    fclose(f);
+    return value;
+}
+
+/* Node of a CPU, 0 when the kernel exposes no NUMA information. */
+int cpu_node(int cpu)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return 0;
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)))
+    {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+        {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+int cmp_compact(const void *a, const void *b)
+{
+    const cpu_info_t *x = a, *y = b;
+    if (x->node != y->node)
+        return x->node - y->node;
+    if (x->package != y->package)
+        return x->package - y->package;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+int cmp_scatter(const void *a, const void *b)
+{
+    const cpu_info_t *x = a, *y = b;
+    if (x->smt != y->smt)
+        return x->smt - y->smt;
+    if (x->core_rank != y->core_rank)
+        return x->core_rank - y->core_rank;
+    if (x->node != y->node)
+        return x->node - y->node;
+    return x->cpu - y->cpu;
+}
+
+/* "0,2,8-11" -> CPUs in that order; -1 if malformed or a CPU is not allowed. */
+int parse_cpu_list(const char *spec, const cpu_set_t *allowed, int *cpus, int max)
+{
+    int count = 0;
+    const char *p = spec;
+    while (*p)
+    {
+        char *end;
+        long first = strtol(p, &end, 10), last;
+        if (end == p || first < 0)
+            return -1;
+        last = first;
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, allowed) || count == max)
+                return -1;
+            cpus[count++] = (int)cpu;
+        }
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        p = end;
+    }
+    return count;
+}
+
+/*
+ * Turns "compact", "scatter" or a CPU list into the CPU of each of the
+ * slots worker slots (the list repeats when shorter). Returns NULL when
+ * the policy is invalid.
+ */
+int *plan_affinity(const char *policy, int slots)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        ERR("sched_getaffinity");
+
+    int ncpus = CPU_COUNT(&allowed);
+    cpu_info_t *info = calloc(ncpus, sizeof(cpu_info_t));
+    int *plan = malloc(sizeof(int) * (slots > ncpus ? slots : ncpus));
+    if (!info || !plan)
+        ERR("malloc");
+
+    int count = 0;
+    if (strcmp(policy, "compact") == 0 || strcmp(policy, "scatter") == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE && count < ncpus; cpu++)
+        {
+            if (!CPU_ISSET(cpu, &allowed))
+                continue;
+            cpu_info_t *c = &info[count++];
+            c->cpu = cpu;
+            c->node = cpu_node(cpu);
+            c->package = read_sys_int("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+            c->core = read_sys_int("/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        }
+        qsort(info, count, sizeof(cpu_info_t), cmp_compact);
+        for (int i = 0; i < count; i++)
+        {
+            cpu_info_t *c = &info[i];
+            if (i == 0 || c->node != info[i - 1].node)
+                c->core_rank = 0, c->smt = 0;
+            else if (c->package == info[i - 1].package && c->core == info[i - 1].core)
+                c->core_rank = info[i - 1].core_rank, c->smt = info[i - 1].smt + 1;
+            else
+                c->core_rank = info[i - 1].core_rank + 1, c->smt = 0;
+        }
+        if (policy[0] == 's')
+            qsort(info, count, sizeof(cpu_info_t), cmp_scatter);
+        for (int i = 0; i < count; i++)
+            plan[i] = info[i].cpu;
+    }
+    else
+        count = parse_cpu_list(policy, &allowed, plan, slots > ncpus ? slots : ncpus);
+    free(info);
+
+    if (count <= 0)
+    {
+        free(plan);
+        return NULL;
+    }
+    for (int i = count; i < slots; i++)
+        plan[i] = plan[i % count];
+    return plan;
+}
+
+/*
+ * Worker state gets its own mapping, bound to node before anything
+ * touches it. mbind is best effort: without NUMA support the pages just
+ * land wherever the first touch happens.
+ */
+worker_t *alloc_worker(int node)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len = (sizeof(worker_t) + page - 1) / page * page;
+    worker_t *w = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (w == MAP_FAILED)
+        ERR("mmap");
+    if (node >= 0 && node < 64)
+    {
+        unsigned long nodemask = 1UL << node;
+        syscall(SYS_mbind, w, len, MPOL_PREFERRED, &nodemask, 64, 0);
+    }
+    return w;
+}
+
+void free_worker(worker_t *w)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    munmap(w, (sizeof(worker_t) + page - 1) / page * page);
+}
+
+/* Steal order for w: other workers on its node first, then the rest. */
+void plan_victims(thread_pool_t *pool, worker_t *w)
+{
+    w->victims = malloc(sizeof(int) * (pool->size > 1 ? pool->size - 1 : 1));
+    if (!w->victims)
+        ERR("malloc");
+    int count = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int i = 0; i < pool->size; i++)
+        {
+            if (i != w->id && (pool->workers[i]->node == w->node) == (pass == 0))
+                w->victims[count++] = i;
+        }
+        if (pass == 0)
+            w->near = count;
+    }
+}
+
+/* Called by a worker that idled past the timeout; 1 if it should exit. */
+int try_retire(worker_t *self)
+{
+    thread_pool_t *pool = self->pool;
+    int retired = 0;
+
+    pthread_mutex_lock(&pool->resize_mtx);
+    if (!atomic_load(&pool->shutdown) && atomic_load(&pool->live) > pool->min_size)
+    {
+        self->state = WORKER_RETIRED;
+        atomic_fetch_sub(&pool->live, 1);
+        retired = 1;
+    }
+    pthread_mutex_unlock(&pool->resize_mtx);
+    return retired;
+}
+
+void *worker_thread(void *args)
+{
+    worker_t *self = (worker_t *)args;
+    thread_pool_t *pool = self->pool;
+    current_worker = self;
+    int timed_out = 0;
+
+    printf("Worker started, TID=%lu\n",
+           (unsigned long)pthread_self());
+
+    while (1)
+    {
+        job_t *job = find_work(self);
+        if (job)
+        {
+            run_job(job);
+            continue;
+        }
+
+        /* nothing found: announce we are about to sleep, then look once more */
+        unsigned int key = ec_prepare(&pool->idle);
+        if ((job = find_work(self)))
+        {
+            ec_cancel(&pool->idle);
+            timed_out = 0;
+            run_job(job);
+            continue;
+        }
+        if (atomic_load(&pool->shutdown))
+        {
+            ec_cancel(&pool->idle);
+            break;
+        }
+        /* the last wait timed out and there is still nothing to do */
+        if (timed_out)
+        {
+            ec_cancel(&pool->idle);
+            if (try_retire(self))
+            {
+                printf("Worker retired, TID=%lu\n", (unsigned long)pthread_self());
+                break;
+            }
+            key = ec_prepare(&pool->idle);
+        }
+        long parked = now_ns();
+        timed_out = ec_wait(&pool->idle, key, pool->idle_timeout_ms);
+        self->metrics.idle_ns += now_ns() - parked;
+    }
+
+    return NULL;
+}
+
+/* Starts a worker in a free slot; returns 0 if the pool is at its maximum or shutting down. */
+int pool_grow(thread_pool_t *pool)
+{
+    int grown = 0;
+
+    pthread_mutex_lock(&pool->resize_mtx);
+    if (!atomic_load(&pool->shutdown) && atomic_load(&pool->live) < pool->size)
+    {
+        for (int i = 0; i < pool->size; i++)
+        {
+            worker_t *w = pool->workers[i];
+            if (w->state == WORKER_RUNNING)
+                continue;
+            if (w->state == WORKER_RETIRED && pthread_join(w->thread, NULL) != 0)
+                ERR("pthread_join");
+
+            pthread_attr_t attr;
+            if (pthread_attr_init(&attr) != 0)
+                ERR("pthread_attr_init");
+            if (w->cpu >= 0)
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(w->cpu, &set);
+                if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set) != 0)
+                    ERR("pthread_attr_setaffinity_np");
+            }
+
+            w->state = WORKER_RUNNING;
+            atomic_fetch_add(&pool->live, 1);
+            if (pthread_create(&w->thread, &attr, worker_thread, w) != 0)
+                ERR("pthread_create");
+            pthread_attr_destroy(&attr);
+            grown = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->resize_mtx);
+    return grown;
+}
+
+
+/*
+ * Starts N workers; the pool may grow to max_size and shrinks back to N.
+ * cpus (from plan_affinity, owned by the pool afterwards) pins slot i to
+ * cpus[i]; NULL leaves placement to the scheduler.
+ */
+thread_pool_t *initialize(int N, int max_size, int queue_capacity, int idle_timeout_ms, int *cpus,
+                          const char *trace_path)
+{
+    if (N <= 0 || max_size < N)
+        ERR("invalid pool size");
+    if (queue_capacity <= 0)
+        ERR("invalid queue capacity");
+
+    thread_pool_t *pool = aligned_alloc(CACHE_LINE, sizeof(thread_pool_t));
+    if (!pool)
+        ERR("aligned_alloc");
+    memset(pool, 0, sizeof(thread_pool_t));
+
+    pool->size = max_size;
+    pool->cpus = cpus;
+    pool->trace_path = trace_path;
+    pool->started_ns = now_ns();
+    pool->min_size = N;
+    pool->idle_timeout_ms = idle_timeout_ms;
+    atomic_init(&pool->live, 0);
+    atomic_init(&pool->shutdown, 0);
+    atomic_init(&pool->due_at, LONG_MAX);
+    pool->capacity = queue_capacity;
+    pool->queue = calloc(queue_capacity, sizeof(job_t *));
+    if (!pool->queue)
+        ERR("calloc");
+    pool->workers = calloc(max_size, sizeof(worker_t *));
+    if (!pool->workers)
+        ERR("calloc");
+
+    if (pthread_mutex_init(&pool->mtx, NULL) != 0)
+        ERR("pthread_mutex_init");
+    if (pthread_mutex_init(&pool->resize_mtx, NULL) != 0)
+        ERR("pthread_mutex_init");
+    if (pthread_cond_init(&pool->not_full, NULL) != 0)
+        ERR("pthread_cond_init");
+
+    for (int i = 0; i < max_size; i++)
+    {
+        int node = cpus ? cpu_node(cpus[i]) : -1;
+        worker_t *w = alloc_worker(node);
+        w->pool = pool;
+        w->id = i;
+        w->seed = 0x9e3779b9u * (i + 1);
+        w->state = WORKER_EMPTY;
+        w->cpu = cpus ? cpus[i] : -1;
+        w->node = node;
+        if (trace_path && !(w->trace = malloc(sizeof(trace_event_t) * TRACE_EVENTS)))
+            ERR("malloc");
+        pool->workers[i] = w;
+    }
+    for (int i = 0; i < max_size; i++)
+        plan_victims(pool, pool->workers[i]);
+    for (int i = 0; i < N; i++)
+        pool_grow(pool);
+
+    return pool;
+}
+
+/*
+ * Makes a job runnable. From inside a pool job it goes onto the
+ * worker's own deque without any locking; from outside it goes through
+ * the injection queue, which only blocks while it is full. One parked
+ * worker is woken, and only if there is one.
+ */
+void submit(thread_pool_t *pool, job_t *job)
+{
+    job->ready_ns = now_ns();
+    job->key = job->deadline_ns ? job->deadline_ns : job->ready_ns + priority_offset_ns[job->priority];
+
+    /* only plain normal jobs skip the priority order by going onto the local deque */
+    worker_t *self = current_worker;
+    if (!self || self->pool != pool || job->priority != PRIORITY_NORMAL || job->deadline_ns ||
+        deque_push(&self->deque, job))
+        queue_push(pool, job);
+    else if (deque_size(&self->deque) > self->metrics.deque_high_water)
+        self->metrics.deque_high_water = deque_size(&self->deque);
+
+    ec_notify(&pool->idle, 0);
+
+    /* nobody parked to take it: the pool is saturated, add a thread if allowed */
+    if (atomic_load(&pool->idle.waiters) == 0 && atomic_load(&pool->live) < pool->size &&
+        (atomic_load_explicit(&pool->queued, memory_order_relaxed) > 0 || (self && deque_size(&self->deque) > 1)))
+        pool_grow(pool);
+}
+
+/* Registers job as a successor of dep; returns 0 if dep has already finished. */
+int add_successor(job_t *dep, job_t *job)
+{
+    successor_t *s = malloc(sizeof(successor_t));
+    if (!s)
+        ERR("malloc");
+    s->job = job;
+    s->next = atomic_load(&dep->successors);
+    do
+    {
+        if (s->next == SUCCESSORS_CLOSED)
+        {
+            free(s);
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak(&dep->successors, &s->next, s));
+    return 1;
+}
+
+/*
+ * Queues work(arg) to run once every job in deps has finished and
+ * returns its handle. Nothing blocks while the dependencies are
+ * outstanding: the last one to finish submits the job. deadline_ns is
+ * an absolute now_ns() time, 0 for none.
+ */
+job_t *dispatch_job(thread_pool_t *pool, job_t **deps, int n, enum job_priority priority, long deadline_ns,
+                    void (*work)(void *),
+                    void *arg)
+{
+    job_t *job = malloc(sizeof(job_t));
+    if (!job)
+        ERR("malloc");
+    job->work_function = work;
+    job->work_arg = arg;
+    job->pool = pool;
+    job->priority = priority;
+    job->deadline_ns = deadline_ns;
+    atomic_init(&job->refs, 2);
+    atomic_init(&job->pending, n + 1);
+    atomic_init(&job->done, 0);
+    atomic_init(&job->waiters, 0);
+    atomic_init(&job->successors, NULL);
+
+    int finished = 1; // the guard taken above
+    for (int i = 0; i < n; i++)
+    {
+        if (!add_successor(deps[i], job))
+            finished++;
+    }
+    if (atomic_fetch_sub(&job->pending, finished) == finished)
+        submit(pool, job);
+
+    return job;
+}
+
+job_t *dispatch_after(thread_pool_t *pool, job_t **deps, int n,
+                      void (*work)(void *),
+                      void *arg)
+{
+    return dispatch_job(pool, deps, n, PRIORITY_NORMAL, 0, work, arg);
+}
+
+job_t *dispatch(thread_pool_t *pool,
+                void (*work)(void *),
+                void *arg)
+{
+    return dispatch_job(pool, NULL, 0, PRIORITY_NORMAL, 0, work, arg);
+}
+
+job_t *dispatch_prio(thread_pool_t *pool, enum job_priority priority, long deadline_ns,
+                     void (*work)(void *),
+                     void *arg)
+{
+    return dispatch_job(pool, NULL, 0, priority, deadline_ns, work, arg);
+}
+
+/* Runs work(arg) after job; returns the continuation's handle. */
+job_t *job_then(job_t *job, void (*work)(void *), void *arg)
+{
+    return dispatch_job(job->pool, &job, 1, job->priority, 0, work, arg);
+}
+
+/* 1 if the job has finished, never blocks. */
+int job_try_wait(job_t *job)
+{
+    return atomic_load(&job->done) != 0;
+}
+
+/*
+ * Blocks until *done is set; whoever sets it wakes *done if *waiters is
+ * non-zero. A pool worker keeps running other jobs while it waits so
+ * that waiting from inside a job cannot starve the pool of threads.
+ */
+void wait_until_done(thread_pool_t *pool, atomic_uint *done, atomic_int *waiters)
+{
+    worker_t *self = current_worker;
+    while (self && self->pool == pool && !atomic_load(done))
+    {
+        job_t *other = find_work(self);
+        if (!other)
+            break;
+        run_job(other);
+    }
+
+    atomic_fetch_add(waiters, 1);
+    while (!atomic_load(done))
+        futex(done, FUTEX_WAIT_PRIVATE, 0);
+    atomic_fetch_sub(waiters, 1);
+}
+
+void job_wait(job_t *job)
+{
+    wait_until_done(job->pool, &job->done, &job->waiters);
+}
+
+/**
+ * Task graphs
+ *
+ * Nodes and edges are collected first, then graph_submit turns every
+ * node into a pool job with dispatch_after, so each node carries an
+ * atomic count of unfinished predecessors and the last predecessor to
+ * finish pushes it onto a worker deque. Nodes are timed as they run and
+ * graph_report prints the per-node times and the critical path.
+ */
+
+typedef struct graph graph_t;
+
+typedef struct graph_node
+{
+    const char *name;
+    void (*work)(void *);
+    void *arg;
+    graph_t *graph;
+
+    int *preds; // slice of graph->preds, filled by graph_sort
+    int pred_count;
+
+    job_t *job;
+    int worker;            // worker id that ran the node
+    long start_ns, end_ns; // relative to graph_submit
+} graph_node_t;
+
+typedef struct graph_edge
+{
+    int from, to;
+} graph_edge_t;
+
+struct graph
+{
+    graph_node_t *nodes;
+    int count;
+    int capacity;
+    graph_edge_t *edges;
+    int edge_count;
+    int edge_capacity;
+    int *preds; // predecessor lists of all nodes, grouped by node
+    int *order; // topological order, filled by graph_submit
+    long submitted_ns;
+    long finished_ns;
+};
+
+graph_t *graph_create(void)
+{
+    graph_t *graph = calloc(1, sizeof(graph_t));
+    if (!graph)
+        ERR("calloc");
+    return graph;
+}
+
+/* Returns the node id used by graph_add_edge. name must outlive the graph. */
+int graph_add_node(graph_t *graph, const char *name, void (*work)(void *), void *arg)
+{
+    if (graph->count == graph->capacity)
+    {
+        graph->capacity = graph->capacity ? 2 * graph->capacity : 16;
+        graph_node_t *nodes = realloc(graph->nodes, sizeof(graph_node_t) * graph->capacity);
+        if (!nodes)
+            ERR("realloc");
+        graph->nodes = nodes;
+    }
+    graph_node_t *node = &graph->nodes[graph->count];
+    memset(node, 0, sizeof(graph_node_t));
+    node->name = name;
+    node->work = work;
+    node->arg = arg;
+    node->graph = graph;
+    return graph->count++;
+}
 
-#define MAX_POOL_SIZE 16
+/* to runs only after from has finished. */
+void graph_add_edge(graph_t *graph, int from, int to)
+{
+    if (graph->edge_count == graph->edge_capacity)
+    {
+        graph->edge_capacity = graph->edge_capacity ? 2 * graph->edge_capacity : 16;
+        graph_edge_t *edges = realloc(graph->edges, sizeof(graph_edge_t) * graph->edge_capacity);
+        if (!edges)
+            ERR("realloc");
+        graph->edges = edges;
+    }
+    graph->edges[graph->edge_count++] = (graph_edge_t){from, to};
+}
 
-typedef struct thread_pool
+void graph_run_node(void *arg)
 {
-    int size;
-    pthread_t threads[MAX_POOL_SIZE];
+    graph_node_t *node = (graph_node_t *)arg;
+    node->worker = current_worker ? current_worker->id : -1;
+    node->start_ns = now_ns() - node->graph->submitted_ns;
+    node->work(node->arg);
+    node->end_ns = now_ns() - node->graph->submitted_ns;
+}
 
-    pthread_mutex_t mtx;
-    pthread_cond_t  cv;
-    void (*work_function)(void *);
-    void *work_arg;
+/*
+ * Kahn's algorithm; returns -1 if the edges contain a cycle. Also groups
+ * the edges into every node's predecessor list.
+ */
+int graph_sort(graph_t *graph)
+{
+    int n = graph->count, edges = graph->edge_count;
+    int *indegree = calloc(n, sizeof(int));
+    int *succ_count = calloc(n + 1, sizeof(int));
+    int *succs = malloc(sizeof(int) * (edges ? edges : 1));
+    int *fill = malloc(sizeof(int) * (n ? n : 1));
+    int *order = malloc(sizeof(int) * (n ? n : 1));
+    int *preds = malloc(sizeof(int) * (edges ? edges : 1));
+    if (!indegree || !succ_count || !succs || !fill || !order || !preds)
+        ERR("malloc");
+
+    /* predecessors of v at graph->preds[sum of indegree below v], in the order the edges were added */
+    for (int e = 0; e < edges; e++)
+    {
+        indegree[graph->edges[e].to]++;
+        succ_count[graph->edges[e].from + 1]++;
+    }
+    for (int v = 0, at = 0; v < n; v++)
+    {
+        graph->nodes[v].preds = preds + at;
+        graph->nodes[v].pred_count = 0;
+        at += indegree[v];
+    }
+    for (int e = 0; e < edges; e++)
+    {
+        graph_node_t *node = &graph->nodes[graph->edges[e].to];
+        node->preds[node->pred_count++] = graph->edges[e].from;
+    }
 
-    int job_available;     // 1 if work is waiting
-    int active_workers;    // number of threads currently working
+    /* successor lists in CSR form: succs[succ_count[v] .. succ_count[v + 1]) */
+    for (int v = 0; v < n; v++)
+        succ_count[v + 1] += succ_count[v];
+    memcpy(fill, succ_count, sizeof(int) * n);
+    for (int e = 0; e < edges; e++)
+        succs[fill[graph->edges[e].from]++] = graph->edges[e].to;
+
+    int head = 0, tail = 0;
+    for (int v = 0; v < n; v++)
+        if (indegree[v] == 0)
+            order[tail++] = v;
+    while (head < tail)
+    {
+        int v = order[head++];
+        for (int i = succ_count[v]; i < succ_count[v + 1]; i++)
+            if (--indegree[succs[i]] == 0)
+                order[tail++] = succs[i];
+    }
 
-    int shutdown;
-} thread_pool_t;
+    free(graph->order);
+    free(graph->preds);
+    graph->order = order;
+    graph->preds = preds;
 
+    free(fill);
+    free(succs);
+    free(succ_count);
+    free(indegree);
+    return tail == n ? 0 : -1;
+}
 
-void *worker_thread(void *args)
+/* Returns -1 without running anything if the graph has a cycle. */
+int graph_submit(thread_pool_t *pool, graph_t *graph)
 {
-    thread_pool_t *pool = (thread_pool_t *)args;
-
-    printf("Worker started, TID=%lu\n",
-           (unsigned long)pthread_self());
+    if (graph_sort(graph) < 0)
+        return -1;
+
+    int max_preds = 1;
+    for (int i = 0; i < graph->count; i++)
+        if (graph->nodes[i].pred_count > max_preds)
+            max_preds = graph->nodes[i].pred_count;
+    job_t **deps = malloc(sizeof(job_t *) * max_preds);
+    if (!deps)
+        ERR("malloc");
 
-    while (1)
+    graph->submitted_ns = now_ns();
+    for (int i = 0; i < graph->count; i++)
     {
-        pthread_mutex_lock(&pool->mtx);
+        graph_node_t *node = &graph->nodes[graph->order[i]];
+        for (int p = 0; p < node->pred_count; p++)
+            deps[p] = graph->nodes[node->preds[p]].job;
+        node->job = dispatch_after(pool, deps, node->pred_count, graph_run_node, node);
+    }
+    free(deps);
+    return 0;
+}
+
+void graph_wait(graph_t *graph)
+{
+    for (int i = 0; i < graph->count; i++)
+        job_wait(graph->nodes[i].job);
+    graph->finished_ns = now_ns() - graph->submitted_ns;
+}
 
-        /* wait for work or shutdown */
-        while (!pool->job_available && !pool->shutdown)
-            pthread_cond_wait(&pool->cv, &pool->mtx);
+/*
+ * Per-node timings plus the critical path by measured run time. Total
+ * work over the critical path is the best speed-up the graph allows; if
+ * the wall time is far above the critical path the pool, not the graph,
+ * is what serialized it.
+ */
+void graph_report(graph_t *graph)
+{
+    int n = graph->count;
+    long *path = malloc(sizeof(long) * (n ? n : 1));
+    int *via = malloc(sizeof(int) * (n ? n : 1));
+    if (!path || !via)
+        ERR("malloc");
 
-        if (pool->shutdown)
+    long work = 0;
+    int last = -1;
+    for (int i = 0; i < n; i++)
+    {
+        int v = graph->order[i];
+        graph_node_t *node = &graph->nodes[v];
+        long duration = node->end_ns - node->start_ns;
+        work += duration;
+        path[v] = 0;
+        via[v] = -1;
+        for (int p = 0; p < node->pred_count; p++)
         {
-            pthread_mutex_unlock(&pool->mtx);
-            break;
+            if (path[node->preds[p]] > path[v])
+            {
+                path[v] = path[node->preds[p]];
+                via[v] = node->preds[p];
+            }
         }
+        path[v] += duration;
+        if (last < 0 || path[v] > path[last])
+            last = v;
+    }
 
-        /* take the job */
-        void (*job)(void *) = pool->work_function;
-        void *arg = pool->work_arg;
+    printf("%-16s %6s %10s %10s %10s\n", "node", "worker", "ready(ms)", "start(ms)", "time(ms)");
+    for (int v = 0; v < n; v++)
+    {
+        graph_node_t *node = &graph->nodes[v];
+        long ready = 0;
+        for (int p = 0; p < node->pred_count; p++)
+            if (graph->nodes[node->preds[p]].end_ns > ready)
+                ready = graph->nodes[node->preds[p]].end_ns;
+        printf("%-16s %6d %10.3f %10.3f %10.3f\n", node->name, node->worker, ready / 1e6, node->start_ns / 1e6,
+               (node->end_ns - node->start_ns) / 1e6);
+    }
 
-        pool->job_available = 0;
-        pool->active_workers++;
+    if (last >= 0)
+    {
+        printf("critical path %.3f ms:", path[last] / 1e6);
+        /* printed from its last node back to its source */
+        for (int v = last; v >= 0; v = via[v])
+            printf(" %s%s", graph->nodes[v].name, via[v] >= 0 ? " <-" : "");
+        printf("\n");
+        printf("work %.3f ms, parallelism %.2f, wall %.3f ms\n", work / 1e6,
+               path[last] ? (double)work / path[last] : 0.0, graph->finished_ns / 1e6);
+    }
 
-        /* notify dispatch that job was taken */
-        pthread_cond_broadcast(&pool->cv);
-        pthread_mutex_unlock(&pool->mtx);
+    free(via);
+    free(path);
+}
 
-        /* execute work OUTSIDE the lock */
-        job(arg);
+void graph_destroy(graph_t *graph)
+{
+    for (int i = 0; i < graph->count; i++)
+        if (graph->nodes[i].job)
+            job_release(graph->nodes[i].job);
+    free(graph->nodes);
+    free(graph->edges);
+    free(graph->preds);
+    free(graph->order);
+    free(graph);
+}
 
-        pthread_mutex_lock(&pool->mtx);
-        pool->active_workers--;
-        pthread_cond_broadcast(&pool->cv);
-        pthread_mutex_unlock(&pool->mtx);
-    }
+/**
+ * Parallel loops
+ *
+ * pool_parallel_for and pool_parallel_reduce run body over [begin, end)
+ * with lazy binary splitting: a worker holding a range hands the upper
+ * half to its deque only while that deque is empty, i.e. while someone
+ * could steal it, and otherwise just works through grain-sized pieces.
+ * A loop over idle workers spreads out in log(P) splits; a loop on a
+ * busy pool costs hardly more than a plain for.
+ */
 
-    return NULL;
-}
+typedef void (*range_body_t)(long begin, long end, void *ctx);
+typedef void (*reduce_body_t)(long begin, long end, void *ctx, void *partial);
+typedef void (*reduce_combine_t)(void *into, const void *from);
+
+typedef struct loop
+{
+    thread_pool_t *pool;
+    long grain;
+    range_body_t for_body;
+    reduce_body_t reduce_body;
+    void *ctx;
+
+    char *partials; // one cache-line-aligned slot per worker
+    size_t stride;
+
+    atomic_long remaining; // iterations not yet run
+    atomic_uint done;
+    atomic_int waiters;
+    atomic_int refs; // the caller's and the finisher's; the loop lives in the caller's frame
+} loop_t;
+
+typedef struct range
+{
+    loop_t *loop;
+    long begin;
+    long end;
+} range_t;
 
+void run_range(void *arg);
 
-thread_pool_t *initialize(int N)
+void loop_chunk(loop_t *loop, long begin, long end)
 {
-    if (N > MAX_POOL_SIZE)
-        ERR("thread pool is too big!");
-    if (N <= 0)
-        ERR("invalid pool size");
+    if (loop->for_body)
+        loop->for_body(begin, end, loop->ctx);
+    else
+        loop->reduce_body(begin, end, loop->ctx, loop->partials + loop->stride * current_worker->id);
 
-    thread_pool_t *pool = calloc(1, sizeof(thread_pool_t));
-    if (!pool)
-        ERR("calloc");
+    if (atomic_fetch_sub(&loop->remaining, end - begin) == end - begin)
+    {
+        atomic_store(&loop->done, 1);
+        if (atomic_load(&loop->waiters) > 0)
+            futex(&loop->done, FUTEX_WAKE_PRIVATE, INT_MAX);
+        atomic_fetch_sub(&loop->refs, 1); // last touch: the caller may return from here on
+    }
+}
+
+void split_range(loop_t *loop, long begin, long end)
+{
+    range_t *r = malloc(sizeof(range_t));
+    if (!r)
+        ERR("malloc");
+    r->loop = loop;
+    r->begin = begin;
+    r->end = end;
+    job_release(dispatch(loop->pool, run_range, r));
+}
 
-    pool->size = N;
-    pool->shutdown = 0;
+/* Always runs on a pool worker. */
+void run_range(void *arg)
+{
+    range_t *r = (range_t *)arg;
+    loop_t *loop = r->loop;
+    long begin = r->begin, end = r->end;
+    free(r);
 
-    if (pthread_mutex_init(&pool->mtx, NULL) != 0)
-        ERR("pthread_mutex_init");
-    if (pthread_cond_init(&pool->cv, NULL) != 0)
-        ERR("pthread_cond_init");
+    deque_t *own = &current_worker->deque;
+    while (end - begin > loop->grain)
+    {
+        /* let due high-priority work in between grains; the rest waits on our deque */
+        if (queue_due(loop->pool))
+        {
+            split_range(loop, begin, end);
+            return;
+        }
+        if (deque_size(own) == 0)
+        {
+            long mid = begin + (end - begin) / 2;
+            split_range(loop, mid, end);
+            end = mid;
+        }
+        else
+        {
+            loop_chunk(loop, begin, begin + loop->grain);
+            begin += loop->grain;
+        }
+    }
+    loop_chunk(loop, begin, end);
+}
 
-    for (int i = 0; i < N; i++)
+void run_loop(loop_t *loop, long begin, long end)
+{
+    atomic_init(&loop->remaining, end - begin);
+    atomic_init(&loop->done, end <= begin);
+    atomic_init(&loop->waiters, 0);
+    atomic_init(&loop->refs, 2);
+    if (end <= begin)
+        return;
+
+    worker_t *self = current_worker;
+    if (self && self->pool == loop->pool)
     {
-        if (pthread_create(&pool->threads[i], NULL, worker_thread, pool) != 0)
-            ERR("pthread_create");
+        range_t *r = malloc(sizeof(range_t));
+        if (!r)
+            ERR("malloc");
+        *r = (range_t){loop, begin, end};
+        run_range(r);
     }
+    else
+        split_range(loop, begin, end);
+    wait_until_done(loop->pool, &loop->done, &loop->waiters);
 
-    return pool;
+    // done can be seen before the finisher is through with the loop; only a few instructions remain
+    while (atomic_load(&loop->refs) > 1)
+        sched_yield();
 }
 
-void dispatch(thread_pool_t *pool,
-              void (*work)(void *),
-              void *arg)
+long default_grain(thread_pool_t *pool, long begin, long end)
 {
-    pthread_mutex_lock(&pool->mtx);
+    long grain = (end - begin) / (8L * atomic_load(&pool->live));
+    return grain > 0 ? grain : 1;
+}
+
+/* Calls body on disjoint sub-ranges covering [begin, end); grain <= 0 picks one. Blocks until done. */
+void pool_parallel_for(thread_pool_t *pool, long begin, long end, long grain, range_body_t body, void *ctx)
+{
+    loop_t loop = {.pool = pool, .for_body = body, .ctx = ctx};
+    loop.grain = grain > 0 ? grain : default_grain(pool, begin, end);
+    run_loop(&loop, begin, end);
+}
+
+/*
+ * Like pool_parallel_for, but body accumulates into the partial of the
+ * worker running it (size bytes, starting as a copy of identity). The
+ * partials are combined into result in worker order, so for exact
+ * operations such as integer sums the result does not depend on how the
+ * range was split or scheduled.
+ */
+void pool_parallel_reduce(thread_pool_t *pool, long begin, long end, long grain, reduce_body_t body,
+                          reduce_combine_t combine, size_t size, const void *identity, void *result, void *ctx)
+{
+    loop_t loop = {.pool = pool, .reduce_body = body, .ctx = ctx};
+    loop.grain = grain > 0 ? grain : default_grain(pool, begin, end);
+    loop.stride = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    loop.partials = aligned_alloc(CACHE_LINE, loop.stride * pool->size);
+    if (!loop.partials)
+        ERR("aligned_alloc");
+    for (int i = 0; i < pool->size; i++)
+        memcpy(loop.partials + loop.stride * i, identity, size);
+
+    run_loop(&loop, begin, end);
+
+    memcpy(result, identity, size);
+    for (int i = 0; i < pool->size; i++)
+        combine(result, loop.partials + loop.stride * i);
+    free(loop.partials);
+}
+
+/* Lower edge of a wait_hist bucket in nanoseconds. */
+long wait_bucket_ns(int bucket)
+{
+    if (bucket < 1 << WAIT_SUB_BITS)
+        return bucket;
+    int msb = (bucket >> WAIT_SUB_BITS) + WAIT_SUB_BITS - 1;
+    long sub = bucket & ((1 << WAIT_SUB_BITS) - 1);
+    return ((1L << WAIT_SUB_BITS) + sub) << (msb - WAIT_SUB_BITS);
+}
 
-    /* wait until there is a free worker and no pending job */
-    while (pool->job_available ||
-           pool->active_workers == pool->size)
+/* Queue-wait percentiles per priority class over every job run so far. */
+void print_wait_stats(thread_pool_t *pool)
+{
+    static const double quantiles[] = {0.5, 0.99, 0.999};
+
+    printf("%-10s %10s %10s %10s %10s %10s\n", "class", "jobs", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    for (int c = 0; c < PRIORITY_CLASSES; c++)
     {
-        pthread_cond_wait(&pool->cv, &pool->mtx);
+        long *hist = calloc(WAIT_BUCKETS, sizeof(long));
+        if (!hist)
+            ERR("calloc");
+        long total = 0;
+        for (int w = 0; w < pool->size; w++)
+            for (int b = 0; b < WAIT_BUCKETS; b++)
+                hist[b] += pool->workers[w]->wait_hist[c][b];
+        for (int b = 0; b < WAIT_BUCKETS; b++)
+            total += hist[b];
+
+        printf("%-10s %10ld", priority_names[c], total);
+        long seen = 0;
+        int b = 0, max = 0;
+        for (int q = 0; q < 3; q++)
+        {
+            long rank = (long)(quantiles[q] * total + 0.5);
+            if (rank < 1)
+                rank = 1;
+            while (b < WAIT_BUCKETS && seen + hist[b] < rank)
+                seen += hist[b++];
+            printf(" %10.1f", total ? wait_bucket_ns(b) / 1e3 : 0.0);
+        }
+        for (int i = 0; i < WAIT_BUCKETS; i++)
+            if (hist[i])
+                max = i;
+        printf(" %10.1f\n", total ? wait_bucket_ns(max + 1) / 1e3 : 0.0);
+        free(hist);
     }
+}
 
-    /* assign job */
-    pool->work_function = work;
-    pool->work_arg = arg;
-    pool->job_available = 1;
+/* Per-worker counters, live. */
+void print_metrics(thread_pool_t *pool)
+{
+    long elapsed = now_ns() - pool->started_ns;
+    worker_metrics_t sum = {0};
 
-    /* wake up workers */
-    pthread_cond_broadcast(&pool->cv);
+    printf("%6s %8s %10s %10s %10s %10s %10s %8s\n", "worker", "jobs", "busy(ms)", "idle(ms)", "lock(us)", "steal try",
+           "stolen", "deque hw");
+    for (int i = 0; i < pool->size; i++)
+    {
+        worker_t *w = pool->workers[i];
+        worker_metrics_t *m = &w->metrics;
+        if (w->state == WORKER_EMPTY)
+            continue;
+        printf("%6d %8ld %10.1f %10.1f %10.1f %10ld %10ld %8ld%s\n", i, m->jobs, m->busy_ns / 1e6, m->idle_ns / 1e6,
+               m->lock_wait_ns / 1e3, m->steal_attempts, m->steals, m->deque_high_water,
+               w->state == WORKER_RETIRED ? " (retired)" : "");
+        sum.jobs += m->jobs;
+        sum.busy_ns += m->busy_ns;
+        sum.idle_ns += m->idle_ns;
+        sum.lock_wait_ns += m->lock_wait_ns;
+        sum.steal_attempts += m->steal_attempts;
+        sum.steals += m->steals;
+        if (m->deque_high_water > sum.deque_high_water)
+            sum.deque_high_water = m->deque_high_water;
+    }
+    printf("%6s %8ld %10.1f %10.1f %10.1f %10ld %10ld %8ld\n", "all", sum.jobs, sum.busy_ns / 1e6, sum.idle_ns / 1e6,
+           sum.lock_wait_ns / 1e3, sum.steal_attempts, sum.steals, sum.deque_high_water);
+    printf("live %d of %d, queued %d, queue high water %d, utilisation %.1f%%\n", atomic_load(&pool->live),
+           pool->size, atomic_load(&pool->queued), pool->high_water,
+           elapsed > 0 ? 100.0 * sum.busy_ns / ((double)elapsed * atomic_load(&pool->live)) : 0.0);
+}
 
-    /* wait until worker takes the job */
-    while (pool->job_available)
-        pthread_cond_wait(&pool->cv, &pool->mtx);
+const char *work_name(void (*work)(void *));
 
-    pthread_mutex_unlock(&pool->mtx);
-}
+/* Chrome trace format ("X" complete events), one row per worker; open in chrome://tracing or Perfetto. */
+void dump_trace(thread_pool_t *pool)
+{
+    FILE *f = fopen(pool->trace_path, "w");
+    if (!f)
+    {
+        perror(pool->trace_path);
+        return;
+    }
 
+    fprintf(f, "{\"traceEvents\":[\n");
+    int first = 1;
+    for (int i = 0; i < pool->size; i++)
+    {
+        worker_t *w = pool->workers[i];
+        if (w->state == WORKER_EMPTY)
+            continue;
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+                first ? "" : ",\n", i, i);
+        first = 0;
+
+        unsigned long from = w->traced > TRACE_EVENTS ? w->traced - TRACE_EVENTS : 0;
+        for (unsigned long e = from; e < w->traced; e++)
+        {
+            trace_event_t *ev = &w->trace[e % TRACE_EVENTS];
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    work_name(ev->work), i, (ev->start_ns - pool->started_ns) / 1e3,
+                    (ev->end_ns - ev->start_ns) / 1e3);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f))
+        perror(pool->trace_path);
+    else
+        printf("trace written to %s\n", pool->trace_path);
+}
 
-void cleanup(thread_pool_t *pool) 
+/*
+ * Lets the workers finish every job that is already queued, including
+ * jobs those jobs dispatch, then joins all threads and frees the pool.
+ * Must not be called while other threads still dispatch to the pool.
+ */
+void cleanup(thread_pool_t *pool)
 {
-    // TODO STAGE-4: Just do it
-    UNUSED(pool);
+    printf("cleanup\n");
+
+    pthread_mutex_lock(&pool->resize_mtx);
+    atomic_store(&pool->shutdown, 1);
+    pthread_mutex_unlock(&pool->resize_mtx);
+    ec_notify(&pool->idle, 1);
+
+    /* no slot changes state once shutdown is set */
+    for (int i = 0; i < pool->size; i++)
+    {
+        if (pool->workers[i]->state != WORKER_EMPTY && pthread_join(pool->workers[i]->thread, NULL) != 0)
+            ERR("pthread_join");
+    }
+    if (pool->trace_path)
+        dump_trace(pool);
+    for (int i = 0; i < pool->size; i++)
+    {
+        free(pool->workers[i]->victims);
+        free(pool->workers[i]->trace);
+        free_worker(pool->workers[i]);
+    }
 
-    printf("cleanup\n"); 
+    pthread_cond_destroy(&pool->not_full);
+    pthread_mutex_destroy(&pool->resize_mtx);
+    pthread_mutex_destroy(&pool->mtx);
+    free(pool->queue);
+    free(pool->workers);
+    free(pool->cpus);
+    free(pool);
 }
 
 /**
@@ -167,17 +1662,17 @@ void circle_monte_carlo(void *args)
         sleep_ms();
     }
     // DO NOT MODIFY CODE ABOVE - IT CALCULATES CIRCLE AREA
-    // TODO STAGE-3: ADD THREADS SYNCHRONIZATION BELOW
 }
 
 void accumulate_monte_carlo(void *args)
 {
     monte_carlo_args_array_t *mc_args = (monte_carlo_args_array_t *)args;
 
-    // TODO STAGE-3: ADD SYNCHRONIZATION WITH WORKING THREAD AND AVERAGE RESULT FROM THEM
+    // runs as a continuation of every sampler, so all hit counts are final here
     int hit_total = 0, samples_total = 0;
     for (int i = 0; i < mc_args->thread_count; i++)
     {
+        hit_total += mc_args->args[i].hit_count;
         samples_total += mc_args->args[i].sample_count;
     }
 
@@ -185,31 +1680,324 @@ void accumulate_monte_carlo(void *args)
     printf("TASK %d, Circle area of radius %f result %lf\n", mc_args->task_idx, mc_args->args[0].radius, res);
 }
 
+typedef struct circle_task
+{
+    thread_pool_t *pool;
+    float radius;
+    unsigned int sample_count;
+    unsigned int seed;
+    long grain;
+    int task_idx;
+} circle_task_t;
+
+/* Seed of sample i, so a sample's point does not depend on the worker that draws it. */
+unsigned int sample_seed(unsigned int seed, long i)
+{
+    unsigned int x = seed ^ (unsigned int)i * 0x9e3779b9u;
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+void circle_sample_range(long begin, long end, void *ctx, void *partial)
+{
+    circle_task_t *task = (circle_task_t *)ctx;
+    long *hits = (long *)partial;
+
+    for (long i = begin; i < end; ++i)
+    {
+        unsigned int seed = sample_seed(task->seed, i);
+        double rand_x = (double)rand_r(&seed) / RAND_MAX;
+        double rand_y = (double)rand_r(&seed) / RAND_MAX;
+
+        if (rand_x * rand_x + rand_y * rand_y <= 1.0)
+            (*hits)++;
+        sleep_ms();
+    }
+}
+
+void sum_hits(void *into, const void *from)
+{
+    *(long *)into += *(const long *)from;
+}
+
+void circle_task(void *args)
+{
+    circle_task_t *task = (circle_task_t *)args;
+    long hits, no_hits = 0;
+
+    pool_parallel_reduce(task->pool, 0, task->sample_count, task->grain, circle_sample_range, sum_hits, sizeof(long),
+                         &no_hits, &hits, task);
+
+    double res = 4 * task->radius * task->radius * (double)hits / task->sample_count;
+    printf("TASK %d, Circle area of radius %f result %lf\n", task->task_idx, task->radius, res);
+    free(task);
+}
+
+/*
+ * Runs as one pool job that reduces over all samples. The range is split
+ * into at most sampling_worker_count pieces, and since every sample has
+ * its own seed the result is the same for any pool size or schedule.
+ */
 void start_monte_carlo(thread_pool_t *pool, int sampling_worker_count, float circle_radius, unsigned int sample_count,
                        int task_idx)
 {
     printf("Starting TASK %d: calculating area of circle with radius %.2f\n", task_idx, circle_radius);
 
+    circle_task_t *task = (circle_task_t *)malloc(sizeof(circle_task_t));
+    if (!task)
+        ERR("malloc");
+    task->pool = pool;
+    task->radius = circle_radius;
+    task->sample_count = sample_count;
+    task->seed = rand();
+    task->grain = (sample_count + sampling_worker_count - 1) / sampling_worker_count;
+    task->task_idx = task_idx;
+
+    job_release(dispatch_prio(pool, PRIORITY_BACKGROUND, 0, circle_task, task));
+}
+
+/* Same computation as start_monte_carlo, built as a graph so its timing can be reported. */
+void start_monte_carlo_graph(thread_pool_t *pool, int sampling_worker_count, float circle_radius,
+                             unsigned int sample_count, int task_idx)
+{
+    printf("Starting TASK %d: calculating area of circle with radius %.2f as a graph\n", task_idx, circle_radius);
+
     monte_carlo_args_array_t *args = (monte_carlo_args_array_t *)malloc(sizeof(monte_carlo_args_array_t));
     if (!args)
         ERR("malloc");
-    args->args = (monte_carlo_args_t *)malloc(sizeof(monte_carlo_args_t));
+    args->args = (monte_carlo_args_t *)malloc(sizeof(monte_carlo_args_t) * sampling_worker_count);
     if (!args->args)
         ERR("malloc");
     args->thread_count = sampling_worker_count;
     args->radius = circle_radius;
     args->task_idx = task_idx;
 
-    // TODO STAGE-3: PASS CORRECT ARGUMENTS TO WORKERS
-    UNUSED(sample_count);
+    char (*names)[24] = malloc(sizeof(*names) * sampling_worker_count);
+    if (!names)
+        ERR("malloc");
 
-    // Every thread will sample sample_count/sampling_worker_count points
+    graph_t *graph = graph_create();
+    int reducer = graph_add_node(graph, "accumulate", accumulate_monte_carlo, args);
     for (int i = 0; i < sampling_worker_count; ++i)
     {
-        dispatch(pool, circle_monte_carlo, &(args->args[i]));
+        monte_carlo_args_t *mc = &args->args[i];
+        mc->radius = circle_radius;
+        mc->sample_count = sample_count / sampling_worker_count + ((unsigned int)i < sample_count % sampling_worker_count);
+        mc->hit_count = 0;
+        mc->seed = rand();
+        snprintf(names[i], sizeof(names[i]), "sample %d", i);
+        graph_add_edge(graph, graph_add_node(graph, names[i], circle_monte_carlo, mc), reducer);
+    }
+
+    if (graph_submit(pool, graph) < 0)
+        ERR("graph_submit");
+    graph_wait(graph);
+    graph_report(graph);
+    graph_destroy(graph);
+    free(names);
+    free(args->args);
+    free(args);
+}
+
+/*
+ * Fast circle estimator: same hit test as circle_monte_carlo, but points
+ * come from eight xoshiro128+ streams advanced side by side, so one
+ * AVX2 step yields eight x or y coordinates. Samples are grouped in
+ * blocks of CIRCLE_BLOCK and every block seeds its own streams from the
+ * task seed, which keeps the result independent of the schedule just
+ * like the pool_parallel_reduce version. The scalar kernel runs the
+ * same lanes, so both kernels count exactly the same hits.
+ */
+
+#define CIRCLE_LANES 8
+#define CIRCLE_BLOCK (1L << 16)
+
+typedef struct circle_lanes
+{
+    uint32_t s[4][CIRCLE_LANES];
+} circle_lanes_t;
+
+uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+void circle_seed_lanes(circle_lanes_t *lanes, uint64_t seed, long block)
+{
+    uint64_t sm = seed ^ (uint64_t)block * 0xd1b54a32d192ed03ull;
+    for (int w = 0; w < 4; w += 2)
+    {
+        for (int l = 0; l < CIRCLE_LANES; l++)
+        {
+            uint64_t r = splitmix64(&sm);
+            lanes->s[w][l] = (uint32_t)r;
+            lanes->s[w + 1][l] = (uint32_t)(r >> 32) | 1; // never all-zero
+        }
+    }
+}
+
+/* xoshiro128+ step on every lane; returns the 24 high bits of each output as floats in [0, 1) */
+static inline void circle_next_scalar(circle_lanes_t *st, float out[CIRCLE_LANES])
+{
+    for (int l = 0; l < CIRCLE_LANES; l++)
+    {
+        uint32_t *s0 = &st->s[0][l], *s1 = &st->s[1][l], *s2 = &st->s[2][l], *s3 = &st->s[3][l];
+        uint32_t result = *s0 + *s3;
+        uint32_t t = *s1 << 9;
+        *s2 ^= *s0;
+        *s3 ^= *s1;
+        *s1 ^= *s2;
+        *s0 ^= *s3;
+        *s2 ^= t;
+        *s3 = (*s3 << 11) | (*s3 >> 21);
+        out[l] = (float)(result >> 8) * 0x1p-24f;
+    }
+}
+
+long circle_block_scalar(circle_lanes_t *st, long samples)
+{
+    long hits = 0;
+    float x[CIRCLE_LANES], y[CIRCLE_LANES];
+    for (long i = 0; i < samples; i += CIRCLE_LANES)
+    {
+        circle_next_scalar(st, x);
+        circle_next_scalar(st, y);
+        int lanes = samples - i < CIRCLE_LANES ? (int)(samples - i) : CIRCLE_LANES;
+        for (int l = 0; l < lanes; l++)
+        {
+            float d = x[l] * x[l];
+            d += y[l] * y[l];
+            hits += d <= 1.0f;
+        }
+    }
+    return hits;
+}
+
+#ifdef CIRCLE_HAVE_X86
+static inline __attribute__((always_inline, target("avx2"))) __m256 circle_next_avx2(__m256i s[4])
+{
+    __m256i result = _mm256_add_epi32(s[0], s[3]);
+    __m256i t = _mm256_slli_epi32(s[1], 9);
+    s[2] = _mm256_xor_si256(s[2], s[0]);
+    s[3] = _mm256_xor_si256(s[3], s[1]);
+    s[1] = _mm256_xor_si256(s[1], s[2]);
+    s[0] = _mm256_xor_si256(s[0], s[3]);
+    s[2] = _mm256_xor_si256(s[2], t);
+    s[3] = _mm256_or_si256(_mm256_slli_epi32(s[3], 11), _mm256_srli_epi32(s[3], 21));
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(result, 8)), _mm256_set1_ps(0x1p-24f));
+}
+
+__attribute__((target("avx2"))) long circle_block_avx2(circle_lanes_t *st, long samples)
+{
+    __m256i s[4];
+    for (int w = 0; w < 4; w++)
+        s[w] = _mm256_loadu_si256((const __m256i *)st->s[w]);
+
+    const __m256 one = _mm256_set1_ps(1.0f);
+    long hits = 0;
+    for (long i = 0; i < samples; i += CIRCLE_LANES)
+    {
+        __m256 x = circle_next_avx2(s);
+        __m256 y = circle_next_avx2(s);
+        // separate mul and add: no FMA, so the rounding matches the scalar kernel
+        __m256 d = _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y));
+        unsigned int inside = (unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(d, one, _CMP_LE_OQ));
+        if (samples - i < CIRCLE_LANES)
+            inside &= (1u << (samples - i)) - 1;
+        hits += __builtin_popcount(inside);
+    }
+
+    for (int w = 0; w < 4; w++)
+        _mm256_storeu_si256((__m256i *)st->s[w], s[w]);
+    return hits;
+}
+#endif
+
+typedef long (*circle_block_fn)(circle_lanes_t *st, long samples);
+
+circle_block_fn circle_pick_kernel(void)
+{
+#ifdef CIRCLE_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return circle_block_avx2;
+#endif
+    return circle_block_scalar;
+}
+
+typedef struct circle_fast_task
+{
+    thread_pool_t *pool;
+    circle_block_fn kernel;
+    float radius;
+    long sample_count;
+    uint64_t seed;
+    long grain;
+    int task_idx;
+} circle_fast_task_t;
+
+/* [begin, end) are block indices */
+void circle_fast_range(long begin, long end, void *ctx, void *partial)
+{
+    circle_fast_task_t *task = (circle_fast_task_t *)ctx;
+    circle_lanes_t lanes;
+
+    for (long block = begin; block < end; ++block)
+    {
+        long samples = task->sample_count - block * CIRCLE_BLOCK;
+        if (samples > CIRCLE_BLOCK)
+            samples = CIRCLE_BLOCK;
+        circle_seed_lanes(&lanes, task->seed, block);
+        *(long *)partial += task->kernel(&lanes, samples);
     }
+}
+
+void circle_fast_task(void *args)
+{
+    circle_fast_task_t *task = (circle_fast_task_t *)args;
+    long blocks = (task->sample_count + CIRCLE_BLOCK - 1) / CIRCLE_BLOCK;
+    long hits, no_hits = 0;
+
+    long start = now_ns();
+    pool_parallel_reduce(task->pool, 0, blocks, task->grain, circle_fast_range, sum_hits, sizeof(long), &no_hits,
+                         &hits, task);
+    double seconds = (now_ns() - start) / 1e9;
+
+    double res = 4 * task->radius * task->radius * (double)hits / task->sample_count;
+    printf("TASK %d, Circle area of radius %f result %lf (%.1f M samples/s)\n", task->task_idx, task->radius, res,
+           task->sample_count / seconds / 1e6);
+    free(task);
+}
 
-    dispatch(pool, accumulate_monte_carlo, args);
+void start_monte_carlo_fast(thread_pool_t *pool, int sampling_worker_count, float circle_radius, long sample_count,
+                            int task_idx)
+{
+    printf("Starting TASK %d: calculating area of circle with radius %.2f (fast)\n", task_idx, circle_radius);
+
+    static circle_block_fn kernel;
+    if (!kernel)
+        kernel = circle_pick_kernel(); // only the CLI thread gets here
+
+    circle_fast_task_t *task = (circle_fast_task_t *)malloc(sizeof(circle_fast_task_t));
+    if (!task)
+        ERR("malloc");
+    long blocks = (sample_count + CIRCLE_BLOCK - 1) / CIRCLE_BLOCK;
+    task->pool = pool;
+    task->kernel = kernel;
+    task->radius = circle_radius;
+    task->sample_count = sample_count;
+    task->seed = (uint64_t)rand() << 32 | (uint64_t)rand();
+    task->grain = (blocks + sampling_worker_count - 1) / sampling_worker_count;
+    task->task_idx = task_idx;
+
+    job_release(dispatch_prio(pool, PRIORITY_BACKGROUND, 0, circle_fast_task, task));
 }
 
 void start_hello_work(thread_pool_t *pool, int sampling_worker_count)
@@ -217,13 +2005,22 @@ void start_hello_work(thread_pool_t *pool, int sampling_worker_count)
     for (int i = 0; i < sampling_worker_count; ++i)
     {
         int* number = (int*)malloc(sizeof(int));
+        if (!number)
+            ERR("malloc");
         *number = i;
 
-        dispatch(pool, hello_world_test, number);
+        job_release(dispatch_prio(pool, PRIORITY_HIGH, 0, hello_world_test, number));
     }
 }
 
-void parse_monte_carlo(thread_pool_t *pool, int worker_count, int task_idx)
+enum circle_mode
+{
+    CIRCLE_POOL,
+    CIRCLE_GRAPH,
+    CIRCLE_FAST,
+};
+
+void parse_monte_carlo(thread_pool_t *pool, int worker_count, int task_idx, enum circle_mode mode)
 {
     float radius = read_float_cli();
     if (radius < 0)
@@ -232,20 +2029,52 @@ void parse_monte_carlo(thread_pool_t *pool, int worker_count, int task_idx)
         return;
     }
 
-    int sample_count = read_int_cli();
-    if (sample_count < worker_count)
+    long sample_count = read_long_cli();
+    if (sample_count < worker_count || (mode != CIRCLE_FAST && sample_count > INT_MAX))
     {
         fprintf(stderr, "Invalid sample count\n");
         return;
     }
 
-    start_monte_carlo(pool, worker_count, radius, sample_count, task_idx);
+    switch (mode)
+    {
+        case CIRCLE_POOL:
+            start_monte_carlo(pool, worker_count, radius, sample_count, task_idx);
+            break;
+        case CIRCLE_GRAPH:
+            start_monte_carlo_graph(pool, worker_count, radius, sample_count, task_idx);
+            break;
+        case CIRCLE_FAST:
+            start_monte_carlo_fast(pool, worker_count, radius, sample_count, task_idx);
+            break;
+    }
+}
+
+const char *work_name(void (*work)(void *))
+{
+    static const struct
+    {
+        void (*work)(void *);
+        const char *name;
+    } names[] = {
+        {hello_world_test, "hello_world_test"},
+        {circle_monte_carlo, "circle_monte_carlo"},
+        {accumulate_monte_carlo, "accumulate_monte_carlo"},
+        {circle_task, "circle_task"},
+        {circle_fast_task, "circle_fast_task"},
+        {run_range, "run_range"},
+        {graph_run_node, "graph_run_node"},
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        if (names[i].work == work)
+            return names[i].name;
+    return "job";
 }
 
 int parse_cli(thread_pool_t *pool)
 {
     int number = read_int_cli();
-    if (number < 1 || number > 3)
+    if (number < 1 || number > 7)
     {
         fprintf(stderr, "Invalid command\n");
         return 1;
@@ -254,9 +2083,19 @@ int parse_cli(thread_pool_t *pool)
     {
         return 0;
     }
+    else if (number == 6)
+    {
+        print_wait_stats(pool);
+        return 1;
+    }
+    else if (number == 7)
+    {
+        print_metrics(pool);
+        return 1;
+    }
 
     int worker_count = read_int_cli();
-    if (worker_count < 1 || worker_count > MAX_POOL_SIZE)
+    if (worker_count < 1 || worker_count > MAX_TASK_WORKERS)
     {
         fprintf(stderr, "Invalid worker_count\n");
         return 1;
@@ -268,43 +2107,96 @@ int parse_cli(thread_pool_t *pool)
     switch (number)
     {
         case 1:
-            parse_monte_carlo(pool, worker_count, task_idx);
+            parse_monte_carlo(pool, worker_count, task_idx, CIRCLE_POOL);
             break;
         case 2:
             start_hello_work(pool, worker_count);
             break;
+        case 4:
+            parse_monte_carlo(pool, worker_count, task_idx, CIRCLE_GRAPH);
+            break;
+        case 5:
+            parse_monte_carlo(pool, worker_count, task_idx, CIRCLE_FAST);
+            break;
     }
     return 1;
 }
 
 int main(int argc, char *argv[])
 {
-    UNUSED(argc);
-    UNUSED(argv);
-
     srand(4);
 
-    if (argc != 2)
+    const char *affinity = NULL, *trace_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:t:")) != -1)
+    {
+        if (opt == 'a')
+            affinity = optarg;
+        else if (opt == 't')
+            trace_path = optarg;
+        else
+            break;
+    }
+
+    int nargs = argc - optind;
+    char **args = argv + optind;
+    if (opt == '?' || nargs < 1 || nargs > 4)
     {
-        printf("%s <N>\n", argv[0]);
+        printf("%s [-a compact|scatter|<cpu list>] [-t trace.json] <N> [queue capacity] [max threads] [idle timeout ms]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    int pool_size = atoi(argv[1]);
+    int pool_size = atoi(args[0]);
     if (pool_size <= 0)
     {
         printf("Invalid thread count");
         exit(EXIT_FAILURE);
     }
 
-    thread_pool_t *pool = initialize(pool_size);
+    int queue_capacity = nargs >= 2 ? atoi(args[1]) : DEFAULT_QUEUE_CAPACITY;
+    if (queue_capacity <= 0)
+    {
+        printf("Invalid queue capacity");
+        exit(EXIT_FAILURE);
+    }
+
+    int max_size = 2 * (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nargs >= 3)
+        max_size = atoi(args[2]);
+    else if (max_size < pool_size)
+        max_size = pool_size;
+    if (max_size < pool_size)
+    {
+        printf("Invalid max thread count");
+        exit(EXIT_FAILURE);
+    }
+
+    int idle_timeout_ms = nargs >= 4 ? atoi(args[3]) : DEFAULT_IDLE_TIMEOUT_MS;
+    if (idle_timeout_ms <= 0)
+    {
+        printf("Invalid idle timeout");
+        exit(EXIT_FAILURE);
+    }
+
+    int *cpus = NULL;
+    if (affinity && !(cpus = plan_affinity(affinity, max_size)))
+    {
+        printf("Invalid affinity");
+        exit(EXIT_FAILURE);
+    }
+
+    thread_pool_t *pool = initialize(pool_size, max_size, queue_capacity, idle_timeout_ms, cpus, trace_path);
 
     do
     {
         printf("\nenter command\n");
         printf("1. circle <n> <r> <s>\n");
         printf("2. hello <n>\n");
-        printf("3. exit\n\n");
+        printf("3. exit\n");
+        printf("4. circle-graph <n> <r> <s>\n");
+        printf("5. circle-fast <n> <r> <s>\n");
+        printf("6. queue-wait\n");
+        printf("7. metrics\n\n");
     } while (parse_cli(pool));
 
 
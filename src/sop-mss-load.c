@@ -0,0 +1,123 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
+
+/*
+ * Join load for sop-mss: starts it with -q, sends joins as SIGRTMIN
+ * sigqueue()s at a fixed rate, then SIGINT, and checks that every join
+ * shows up in its final "joined, turned away" line. When the receiver's
+ * real-time signal queue is full sigqueue fails with EAGAIN and the join
+ * is retried, so a join can be slow but never dropped.
+ */
+
+void usage(const char *program_name)
+{
+    fprintf(stderr, "USAGE: %s [-r joins/s] [-s seconds] [-b joins per signal] [-t tables] [-p sop-mss] n\n", program_name);
+    exit(EXIT_FAILURE);
+}
+
+double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    long rate = 100000;
+    double seconds = 3;
+    int per_signal = 1, c;
+    const char *tables = "10000", *path = "./sop-mss";
+    int fds[2];
+
+    while ((c = getopt(argc, argv, "r:s:b:t:p:")) != -1)
+    {
+        switch (c)
+        {
+            case 'r': rate = atol(optarg); break;
+            case 's': seconds = atof(optarg); break;
+            case 'b': per_signal = atoi(optarg); break;
+            case 't': tables = optarg; break;
+            case 'p': path = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1 || rate < 1 || seconds <= 0 || per_signal < 1)
+        usage(argv[0]);
+
+    // the server inherits the mask, so no join can arrive before its signalfd exists
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGRTMIN);
+    sigaddset(&mask, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL))
+        ERR("sigprocmask");
+    if (pipe(fds))
+        ERR("pipe");
+    pid_t pid = fork();
+    if (pid == -1)
+        ERR("fork");
+    if (pid == 0)
+    {
+        if (dup2(fds[1], STDOUT_FILENO) == -1)
+            ERR("dup2");
+        close(fds[0]);
+        close(fds[1]);
+        execl(path, path, "-q", "-t", tables, argv[optind], (char *)NULL);
+        ERR("execl");
+    }
+    close(fds[1]);
+
+    long signals = (long)(rate * seconds) / per_signal, sent = 0, retries = 0;
+    union sigval value = {.sival_int = per_signal};
+    double t0 = now_s();
+    while (sent < signals)
+    {
+        long due = (long)((now_s() - t0) * rate) / per_signal;
+        if (due > signals)
+            due = signals;
+        while (sent < due)
+        {
+            if (sigqueue(pid, SIGRTMIN, value) == 0)
+                sent++;
+            else if (errno == EAGAIN)
+            {
+                retries++;
+                sched_yield();
+            }
+            else
+                ERR("sigqueue");
+        }
+        struct timespec tick = {0, 100000L};
+        nanosleep(&tick, NULL);
+    }
+    double elapsed = now_s() - t0;
+    if (kill(pid, SIGINT))
+        ERR("kill");
+
+    FILE *out = fdopen(fds[0], "r");
+    if (!out)
+        ERR("fdopen");
+    long joined = -1, away = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), out))
+        sscanf(line, "%ld players joined, %ld turned away", &joined, &away);
+    fclose(out);
+    if (waitpid(pid, NULL, 0) == -1)
+        ERR("waitpid");
+
+    long joins = sent * per_signal;
+    printf("sent %ld joins in %.2f s (%.0f/s, %ld EAGAIN retries): %ld joined, %ld turned away, %ld lost\n",
+           joins, elapsed, joins / elapsed, retries, joined, away, joins - joined - away);
+    return joined + away == joins ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,11 +1,16 @@
 #define _POSIX_C_SOURCE 200809L
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
 #include <time.h>
 #include <unistd.h>
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
@@ -13,85 +18,370 @@
 
 #define DECK_SIZE (4 * 13)
 #define HAND_SIZE (7)
-volatile sig_atomic_t sigusr1_count = 0;
-volatile sig_atomic_t sigint_received = 0;
+#define MAX_SEATS 7
+#define ROUNDS_PER_STEP 64 // a table goes back to the ready queue after this many rounds
+#define MAX_ROUNDS 1000    // a game still open after this many rounds is a draw; won games take about 7
+#define SIG_BATCH 256      // signals taken from the signalfd per read
 
 void print_deck(const int *deck, int size);
-void shuffle(int *array, size_t n);
-
+void shuffle(int *array, size_t n, unsigned *seed);
 
+/*
+ * Bounded lock-free MPMC queue (Vyukov). Every cell carries a sequence
+ * number that tells producers and consumers whose turn it is, so a push
+ * or pop is one CAS on head or tail plus a release store on the cell.
+ */
 typedef struct
 {
-    int seated;           // how many players are currently at the table
-    int table_size;       // n
-    int game_active;      // 0 = waiting, 1 = table full
-    int shutdown;         // set when SIGINT arrives
+    _Atomic size_t seq;
+    void *data;
+} mpmc_cell_t;
 
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
+typedef struct
+{
+    mpmc_cell_t *cells;
+    size_t mask;
+    _Alignas(64) _Atomic size_t head; // next push
+    _Alignas(64) _Atomic size_t tail; // next pop
+} mpmc_t;
+
+/* capacity is rounded up to a power of two */
+void mpmc_init(mpmc_t *q, size_t capacity)
+{
+    size_t size = 2;
+    while (size < capacity)
+        size <<= 1;
+    if (!(q->cells = malloc(sizeof(mpmc_cell_t) * size)))
+        ERR("malloc");
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&q->cells[i].seq, i);
+    q->mask = size - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+}
 
-    int game_over;          
-    int winner_count;       
+/* -1 when full */
+int mpmc_push(mpmc_t *q, void *data)
+{
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    for (;;)
+    {
+        mpmc_cell_t *cell = &q->cells[pos & q->mask];
+        intptr_t dif = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)pos;
+        if (dif == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                cell->data = data;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return 0;
+            }
+        }
+        else if (dif < 0)
+            return -1;
+        else
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+}
 
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
+/* -1 when empty, or when the next item is claimed but not yet published */
+int mpmc_pop(mpmc_t *q, void **data)
+{
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    for (;;)
+    {
+        mpmc_cell_t *cell = &q->cells[pos & q->mask];
+        intptr_t dif = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)(pos + 1);
+        if (dif == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                *data = cell->data;
+                atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+                return 0;
+            }
+        }
+        else if (dif < 0)
+            return -1;
+        else
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+}
 
-    pthread_barrier_t round_barrier; 
-} table_t;
-typedef struct{
+typedef struct
+{
     int id;
     int hand[HAND_SIZE];
-    table_t* table;
-}player_arg_t;
-
-
-void sigusr1_handler(int sig)
+} player_t;
+
+/*
+ * A table has no lock: it belongs to whoever took it off a queue. The
+ * main thread fills it from the open queue, and once every seat is
+ * taken it is handed to the workers through the ready queue, which run
+ * the game a slice of rounds at a time.
+ */
+typedef struct
 {
-    UNUSED(sig);
-    sigusr1_count++;
-}
+    int id;
+    int seated;     // how many players are currently at the table
+    int table_size; // n
+    int rounds;     // rounds played in the current game
+    int deck[DECK_SIZE];
+    int deck_index;
+    unsigned seed;
+    player_t players[MAX_SEATS];
+} table_t;
 
-void sigint_handler(int sig)
+typedef struct
 {
-    UNUSED(sig);
-    sigint_received=1;
-}
+    table_t *tables;
+    int table_count;
+    mpmc_t open;           // tables with free seats
+    atomic_int open_count; // tables pushed to open and not yet popped
+    mpmc_t ready;          // full tables waiting for a worker
+    sem_t ready_count;
+    atomic_int shutdown;
+    atomic_long games;
+    long turned_away;
+    int quiet;
+} server_t;
+
 void usage(const char *program_name)
 {
-    fprintf(stderr, "USAGE: %s n\n", program_name);
+    fprintf(stderr, "USAGE: %s [-t tables] [-w workers] [-q] n\n", program_name);
     exit(EXIT_FAILURE);
 }
 
-void shuffle(int *array, size_t n)
+void shuffle(int *array, size_t n, unsigned *seed)
 {
     if (n > 1)
     {
         size_t i;
         for (i = 0; i < n - 1; i++)
         {
-            size_t j = i + rand() / (RAND_MAX / (n - i) + 1);
+            size_t j = i + rand_r(seed) / (RAND_MAX / (n - i) + 1);
             int t = array[j];
             array[j] = array[i];
             array[i] = t;
         }
     }
 }
-void* player_thread(void* arg)
+
+void reset_table(table_t *t)
+{
+    t->seated = 0;
+    t->rounds = 0;
+    t->deck_index = 0;
+    for (int i = 0; i < DECK_SIZE; ++i)
+        t->deck[i] = i;
+    shuffle(t->deck, DECK_SIZE, &t->seed);
+}
+
+void make_open(server_t *s, table_t *t)
+{
+    if (mpmc_push(&s->open, t))
+        ERR("open queue full"); // every table fits, so this cannot happen
+    atomic_fetch_add(&s->open_count, 1);
+}
+
+/*
+ * 0 when every table is in play. A pop can fail while tables are open:
+ * a push ahead of theirs has claimed its slot but not yet published it.
+ */
+int take_open(server_t *s, table_t **t)
+{
+    if (atomic_load(&s->open_count) == 0)
+        return 0;
+    while (mpmc_pop(&s->open, (void **)t))
+        sched_yield();
+    atomic_fetch_sub(&s->open_count, 1);
+    return 1;
+}
+
+void make_ready(server_t *s, table_t *t)
+{
+    if (mpmc_push(&s->ready, t))
+        ERR("ready queue full"); // every table fits, so this cannot happen
+    if (sem_post(&s->ready_count))
+        ERR("sem_post");
+}
+
+/*
+ * The game. The original server only dealt the hands, so the rules are
+ * this server's own: every player is dealt HAND_SIZE cards, and each
+ * round every player passes a card of the suit they hold fewest of to
+ * the player on their right. A player holding a single suit after a
+ * round wins (several may win the same round); a game still open after
+ * MAX_ROUNDS rounds is a draw.
+ */
+
+/* Index of a card of the suit this hand holds fewest of. */
+int card_to_pass(const int *hand, unsigned *seed)
+{
+    int count[4] = {0};
+    for (int i = 0; i < HAND_SIZE; i++)
+        count[hand[i] % 4]++;
+    int best = -1, ties = 0;
+    for (int i = 0; i < HAND_SIZE; i++)
+    {
+        if (best >= 0 && count[hand[i] % 4] > count[hand[best] % 4])
+            continue;
+        if (best >= 0 && count[hand[i] % 4] == count[hand[best] % 4])
+        {
+            // pick uniformly among the ties so games do not cycle
+            if (rand_r(seed) % ++ties == 0)
+                best = i;
+            continue;
+        }
+        best = i;
+        ties = 1;
+    }
+    return best;
+}
+
+int one_suit(const int *hand)
+{
+    for (int i = 1; i < HAND_SIZE; i++)
+        if (hand[i] % 4 != hand[0] % 4)
+            return 0;
+    return 1;
+}
+
+/* Every player passes one card to the right. Returns how many now hold a single suit. */
+int play_round(table_t *t)
+{
+    int idx[MAX_SEATS], out[MAX_SEATS], winners = 0;
+    for (int i = 0; i < t->table_size; i++)
+    {
+        idx[i] = card_to_pass(t->players[i].hand, &t->seed);
+        out[i] = t->players[i].hand[idx[i]];
+    }
+    for (int i = 0; i < t->table_size; i++)
+    {
+        int right = (i + 1) % t->table_size;
+        t->players[right].hand[idx[right]] = out[i];
+    }
+    t->rounds++;
+    for (int i = 0; i < t->table_size; i++)
+        winners += one_suit(t->players[i].hand);
+    return winners;
+}
+
+/* Runs one slice of a game; a finished table goes back to the open queue. */
+void play_step(server_t *s, table_t *t)
+{
+    int winners = 0;
+    for (int i = 0; i < ROUNDS_PER_STEP && !winners && t->rounds < MAX_ROUNDS; i++)
+        winners = play_round(t);
+    if (!winners && t->rounds < MAX_ROUNDS)
+    {
+        make_ready(s, t);
+        return;
+    }
+
+    if (!s->quiet)
+    {
+        flockfile(stdout);
+        if (!winners)
+            printf("Table %d: draw after %d rounds\n", t->id, t->rounds);
+        for (int i = 0; i < t->table_size; i++)
+            if (one_suit(t->players[i].hand))
+            {
+                printf("Table %d: player %d won after %d rounds with ", t->id, t->players[i].id, t->rounds);
+                print_deck(t->players[i].hand, HAND_SIZE);
+            }
+        funlockfile(stdout);
+    }
+    atomic_fetch_add_explicit(&s->games, 1, memory_order_relaxed);
+    reset_table(t);
+    make_open(s, t);
+}
+
+void* worker_thread(void* arg)
+{
+    server_t *s = arg;
+    table_t *t;
+
+    for (;;)
+    {
+        if (sem_wait(&s->ready_count))
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("sem_wait");
+        }
+        if (atomic_load(&s->shutdown))
+            break;
+        // the post means a push has claimed its slot; it may still be publishing
+        while (mpmc_pop(&s->ready, (void **)&t))
+            sched_yield();
+        play_step(s, t);
+    }
+    return NULL;
+}
+
+/*
+ * Seats a batch of joins, taking tables from the open queue as the one
+ * being filled runs out of seats. Joins that find every table in play
+ * are turned away. The batch is printed under one stdio lock.
+ */
+void seat_players(server_t *s, table_t **filling, int *next_player_id, long joins)
 {
-    player_arg_t* p = arg;
+    long away = 0;
+
+    if (!s->quiet)
+        flockfile(stdout);
+    for (; joins > 0; joins--)
+    {
+        if (!*filling && !take_open(s, filling))
+        {
+            away = joins;
+            break;
+        }
+        table_t *t = *filling;
+        player_t *p = &t->players[t->seated++];
+        p->id = (*next_player_id)++;
+        for (int j = 0; j < HAND_SIZE; j++)
+            p->hand[j] = t->deck[t->deck_index++];
 
-    printf("Player %d hand: ", p->id);
-    print_deck(p->hand, HAND_SIZE);
+        if (!s->quiet)
+        {
+            printf("Player %d (table %d) hand: ", p->id, t->id);
+            print_deck(p->hand, HAND_SIZE);
+        }
+        if (t->seated == t->table_size)
+        {
+            *filling = NULL;
+            make_ready(s, t);
+        }
+    }
+    if (away && !s->quiet)
+        printf("Table full (%ld turned away)\n", away);
+    if (!s->quiet)
+        funlockfile(stdout);
+    s->turned_away += away;
+}
 
-    pthread_mutex_lock(&p->table->mutex);
-    while(!p->table->game_active && !p->table->shutdown)
+/*
+ * Turns a batch of signals into joins. SIGUSR1 is one join, but plain
+ * signals coalesce, so loaders should use SIGRTMIN: real-time signals
+ * queue, and the sigqueue payload is the number of players joining.
+ */
+long count_joins(const struct signalfd_siginfo *info, int n, int *stop)
+{
+    long joins = 0;
+    for (int i = 0; i < n; i++)
     {
-        pthread_cond_wait(&p->table->cond, &p->table->mutex);
+        if ((int)info[i].ssi_signo == SIGINT)
+            *stop = 1;
+        else if ((int)info[i].ssi_signo == SIGUSR1)
+            joins++;
+        else
+            joins += info[i].ssi_code == SI_QUEUE && info[i].ssi_int > 0 ? info[i].ssi_int : 1;
     }
-    pthread_mutex_unlock(&p->table->mutex);
-    if (p->table->shutdown)
-        return NULL;
+    return joins;
 }
+
 void print_deck(const int *deck, int size)
 {
     const char *suits[] = {" of Hearts", " of Diamonds", " of Clubs", " of Spades"};
@@ -124,83 +414,97 @@ void print_deck(const int *deck, int size)
 
 int main(int argc, char *argv[])
 {
-    
-
-    if(argc!=2) {usage(argv[0]);}
-    int n = atoi(argv[1]);
-
-    if (n < 4 || n > 7){usage(argv[0]);}
-    srand(time(NULL));
-
-
-    struct sigaction sa = {0};
-    sa.sa_handler = sigusr1_handler;
-    sigaction(SIGUSR1, &sa, NULL);
-
-    sa.sa_handler = sigint_handler;
-    sigaction(SIGINT, &sa, NULL);
-
+    server_t s;
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN), c;
 
-    int deck[DECK_SIZE];
-    for (int i = 0; i < DECK_SIZE; ++i)
-        deck[i] = i;
-    shuffle(deck, DECK_SIZE);
-
-
-    table_t table = {
-    .seated = 0,
-    .table_size = n,
-    .game_active = 0,
-    .shutdown = 0,
-    .mutex = PTHREAD_MUTEX_INITIALIZER,
-    .cond = PTHREAD_COND_INITIALIZER
-    };
+    memset(&s, 0, sizeof(s));
+    s.table_count = 1;
+    while ((c = getopt(argc, argv, "t:w:q")) != -1)
+    {
+        switch (c)
+        {
+            case 't': s.table_count = atoi(optarg); break;
+            case 'w': workers = atoi(optarg); break;
+            case 'q': s.quiet = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(argc - optind != 1) {usage(argv[0]);}
+    int n = atoi(argv[optind]);
 
-    pthread_t threads[n];
-    player_arg_t args[n];
+    if (n < 4 || n > MAX_SEATS || s.table_count < 1 || workers < 1){usage(argv[0]);}
+    unsigned seed = (unsigned)time(NULL);
 
-    int next_player_id = 0;
 
-    int deck_index = 0;
+    if (!(s.tables = calloc(s.table_count, sizeof(table_t))))
+        ERR("calloc");
+    mpmc_init(&s.open, s.table_count);
+    mpmc_init(&s.ready, s.table_count);
+    if (sem_init(&s.ready_count, 0, 0))
+        ERR("sem_init");
+    for (int i = 0; i < s.table_count; i++)
+    {
+        s.tables[i].id = i;
+        s.tables[i].table_size = n;
+        s.tables[i].seed = rand_r(&seed);
+        reset_table(&s.tables[i]);
+        make_open(&s, &s.tables[i]);
+    }
 
-    while(!sigint_received)
+    // blocked everywhere (workers inherit the mask) and read from the signalfd
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGRTMIN);
+    sigaddset(&mask, SIGINT);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL))
+        ERR("pthread_sigmask");
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sfd == -1)
+        ERR("signalfd");
+    pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+    if (!threads)
+        ERR("malloc");
+    for (int i = 0; i < workers; i++)
+        if (pthread_create(&threads[i], NULL, worker_thread, &s) != 0) {ERR("Error creating thread");}
+
+    struct signalfd_siginfo info[SIG_BATCH];
+    table_t *filling = NULL;
+    int next_player_id = 0, stop = 0;
+
+    while(1)
     {
-        pause();
-        if(sigusr1_count>0)
+        ssize_t got = read(sfd, info, sizeof(info));
+        if (got == -1)
         {
-            sigusr1_count--;
-            pthread_mutex_lock(&table.mutex);
-            if(table.seated==table.table_size)
-            {
-                printf("Table full\n");
-                pthread_mutex_unlock(&table.mutex);
+            // after SIGINT the fd is non-blocking and empty means every queued join is in
+            if (errno == EAGAIN)
+                break;
+            if (errno == EINTR)
                 continue;
-
-            }
-
-            int id = next_player_id++;
-            table.seated++;
-            args[id].id = id;
-            args[id].table = &table;
-            for(int j=0; j<HAND_SIZE; j++)
-            {
-                args[id].hand[j] = deck[deck_index++];
-            }
-
-            if(pthread_create(&threads[id], NULL, player_thread, &args[id])!=0) {ERR("Error creating thread");}
-            if(table.seated==table.table_size)
-            {
-                table.game_active=1;
-                pthread_cond_broadcast(&table.cond);
-            }
-
-
-            pthread_mutex_unlock(&table.mutex);
+            ERR("read");
         }
+        int was_stopping = stop;
+        seat_players(&s, &filling, &next_player_id, count_joins(info, (int)(got / sizeof(*info)), &stop));
+        // SIGINT is dequeued before real-time signals sent earlier, so drain those first
+        if (stop && !was_stopping && fcntl(sfd, F_SETFL, O_NONBLOCK) == -1)
+            ERR("fcntl");
     }
-    for (int i = 0; i < n; i++)
+    close(sfd);
+
+    atomic_store(&s.shutdown, 1);
+    for (int i = 0; i < workers; i++)
+        if (sem_post(&s.ready_count)) {ERR("sem_post");}
+    for (int i = 0; i < workers; i++)
     {
         if (pthread_join(threads[i], NULL) != 0) {ERR("pthread_join");}
     }
+    printf("%d players joined, %ld turned away, %ld games finished\n", next_player_id, s.turned_away, atomic_load(&s.games));
+
+    sem_destroy(&s.ready_count);
+    free(s.open.cells);
+    free(s.ready.cells);
+    free(s.tables);
+    free(threads);
     exit(EXIT_SUCCESS);
 }
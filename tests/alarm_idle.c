@@ -0,0 +1,37 @@
+/*
+ * The wheel only moves when the timerfd fires, so after an idle spell it
+ * lags behind the clock. A delay near the maximum set then must still be
+ * placed at its real deadline, not clamped to the lagging wheel's range.
+ */
+#define main alarm_main
+#include "../alarm.c"
+#undef main
+
+int main(void)
+{
+    alarm_clock_t clock;
+    struct timespec idle = {0, 50 * 1000000L};
+
+    alarm_clock_init(&clock);
+    nanosleep(&idle, NULL); // about 5000 ticks the wheel does not see
+
+    uint64_t id = alarm_set(&clock, MAX_DELAY_NS);
+    alarm_t *a = alarm_at(&clock, (uint32_t)id);
+    long rings_at = clock.base_ns + (long)a->timer.expires * TICK_NS;
+    if (rings_at < a->deadline) {
+        fprintf(stderr, "alarm_idle: maximum delay would ring %.3f ms early\n", (a->deadline - rings_at) / 1e6);
+        return EXIT_FAILURE;
+    }
+
+    // a short alarm set after the same idle spell still rings on time
+    alarm_set(&clock, 1000000L);
+    nanosleep(&idle, NULL);
+    alarm_fire(&clock);
+    if (clock.fired != 1) {
+        fprintf(stderr, "alarm_idle: %ld alarms rang, expected 1\n", clock.fired);
+        return EXIT_FAILURE;
+    }
+
+    alarm_clock_free(&clock);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,196 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hierarchical timing wheel (Varghese & Lauck, cascading like the old
+ * Linux timer code). Time is counted in ticks chosen by the caller.
+ * Level L has 64 slots of 64^L ticks each, so six levels cover 2^36
+ * ticks. Timers are intrusive doubly linked list nodes: adding and
+ * cancelling is O(1), and advancing visits only occupied slots thanks
+ * to a per-level occupancy bitmap. The wheel does no locking.
+ */
+
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_LEVELS 6
+#define TW_MAX_DELTA (((uint64_t)1 << (TW_BITS * TW_LEVELS)) - 1)
+
+typedef struct tw_timer {
+    struct tw_timer *next, *prev;
+    uint64_t expires;  // tick
+    uint16_t level;
+    uint16_t slot;
+} tw_timer_t;
+
+typedef struct {
+    uint64_t now;                       // last tick processed
+    uint64_t occupied[TW_LEVELS];       // bit s set when slots[L][s] is not empty
+    tw_timer_t slots[TW_LEVELS][TW_SLOTS]; // list heads
+    size_t count;
+} timer_wheel_t;
+
+static inline void tw_list_init(tw_timer_t *head)
+{
+    head->next = head->prev = head;
+}
+
+static inline void tw_list_add(tw_timer_t *head, tw_timer_t *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static inline void tw_list_del(tw_timer_t *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = t;
+}
+
+static inline void tw_init(timer_wheel_t *w, uint64_t now)
+{
+    w->now = now;
+    w->count = 0;
+    for (int l = 0; l < TW_LEVELS; l++) {
+        w->occupied[l] = 0;
+        for (int s = 0; s < TW_SLOTS; s++)
+            tw_list_init(&w->slots[l][s]);
+    }
+}
+
+static inline void tw_place(timer_wheel_t *w, tw_timer_t *t)
+{
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+    while (level < TW_LEVELS - 1 && delta >= (uint64_t)1 << (TW_BITS * (level + 1)))
+        level++;
+    int slot = (int)((t->expires >> (TW_BITS * level)) & TW_MASK);
+    t->level = (uint16_t)level;
+    t->slot = (uint16_t)slot;
+    tw_list_add(&w->slots[level][slot], t);
+    w->occupied[level] |= (uint64_t)1 << slot;
+}
+
+/*
+ * Expiries at or before now fire on the next advance. Ones more than
+ * TW_MAX_DELTA past now are clamped, so a caller that lets the wheel lag
+ * behind its clock must advance it before adding long timers.
+ */
+static inline void tw_add(timer_wheel_t *w, tw_timer_t *t, uint64_t expires)
+{
+    if (expires <= w->now)
+        expires = w->now + 1;
+    if (expires - w->now > TW_MAX_DELTA)
+        expires = w->now + TW_MAX_DELTA;
+    t->expires = expires;
+    tw_place(w, t);
+    w->count++;
+}
+
+static inline void tw_cancel(timer_wheel_t *w, tw_timer_t *t)
+{
+    tw_list_del(t);
+    if (w->slots[t->level][t->slot].next == &w->slots[t->level][t->slot])
+        w->occupied[t->level] &= ~((uint64_t)1 << t->slot);
+    w->count--;
+}
+
+/* Moves every timer of slots[level][slot] back into the wheel relative to now. */
+static inline void tw_cascade(timer_wheel_t *w, int level, int slot)
+{
+    tw_timer_t *head = &w->slots[level][slot];
+    tw_timer_t pending;
+    if (head->next == head)
+        return;
+    // detach the whole list first: re-placing may land in this very slot
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    tw_list_init(head);
+    w->occupied[level] &= ~((uint64_t)1 << slot);
+
+    while (pending.next != &pending) {
+        tw_timer_t *t = pending.next;
+        tw_list_del(t);
+        tw_place(w, t);
+    }
+}
+
+/*
+ * First tick after now at which something happens: a level-0 slot
+ * fires or a non-empty slot cascades. Empty stretches of the wheel are
+ * skipped a whole slot (or level rotation) at a time. Requires count > 0.
+ */
+static inline uint64_t tw_next_event(const timer_wheel_t *w)
+{
+    for (int l = 0; l < TW_LEVELS; l++) {
+        int shift = TW_BITS * l;
+        int at = (int)((w->now >> shift) & TW_MASK);
+        uint64_t later = at == TW_MASK ? 0 : w->occupied[l] & (~(uint64_t)0 << (at + 1));
+        if (later)
+            return (((w->now >> shift) & ~(uint64_t)TW_MASK) + (uint64_t)__builtin_ctzll(later)) << shift;
+        // timers behind the index belong to the next rotation of this level
+        if (w->occupied[l])
+            return ((w->now >> (shift + TW_BITS)) + 1) << (shift + TW_BITS);
+    }
+    return UINT64_MAX;
+}
+
+/*
+ * Advances to tick target and appends every timer that expired on the
+ * way to the list at expired (initialised with tw_list_init), in expiry
+ * order. They are no longer in the wheel.
+ */
+static inline void tw_advance(timer_wheel_t *w, uint64_t target, tw_timer_t *expired)
+{
+    while (w->now < target) {
+        if (w->count == 0) {
+            w->now = target;
+            break;
+        }
+        uint64_t next = tw_next_event(w);
+        if (next > target) {
+            w->now = target;
+            break;
+        }
+        w->now = next;
+
+        // skipped cascades were of empty slots
+        if ((next & TW_MASK) == 0) {
+            for (int l = 1; l < TW_LEVELS; l++) {
+                int slot = (int)((next >> (TW_BITS * l)) & TW_MASK);
+                tw_cascade(w, l, slot);
+                if (slot != 0)
+                    break;
+            }
+        }
+
+        int slot = (int)(next & TW_MASK);
+        tw_timer_t *head = &w->slots[0][slot];
+        while (head->next != head) {
+            tw_timer_t *t = head->next;
+            tw_list_del(t);
+            tw_list_add(expired, t);
+            w->count--;
+        }
+        w->occupied[0] &= ~((uint64_t)1 << slot);
+    }
+}
+
+/*
+ * Tick at which the caller should call tw_advance next: when a level-0
+ * slot fires or timers cascade down a level. UINT64_MAX when empty.
+ */
+static inline uint64_t tw_next_tick(const timer_wheel_t *w)
+{
+    return w->count ? tw_next_event(w) : UINT64_MAX;
+}
+
+#endif